@@ -24,10 +24,31 @@
 #include <linux/spi/spi.h>
 #include <linux/spi/ads7846.h>
 #include <linux/gpio.h>
+#include <linux/slab.h>
+#include <linux/jiffies.h>
+#include <linux/input.h>
+#include <linux/spinlock.h>
+#include <linux/lockdep.h>
+#include <linux/math64.h>
+#include <linux/interrupt.h>
+#include <linux/hrtimer.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/tracepoint.h>
 #include <asm/irq.h>
 
 #define DRVNAME "ads7846_device"
 
+#define CREATE_TRACE_POINTS
+#include "ads7846_device_trace.h"
+
+#define LATENCY_TRACE_IRQ(irq)		trace_ads7846_device_irq(irq)
+#define LATENCY_TRACE_EVENT(ns)		trace_ads7846_device_event(ns)
+#include "latency_stats.h"
+#include "touch_calib.h"
+
 
 static unsigned int verbose = 0;
 module_param(verbose, uint, 0);
@@ -61,7 +82,23 @@ MODULE_PARM_DESC(model, "Touch Controller model: 7843, 7845, 7846, 7873 (default
 
 static int gpio_pendown = -1;
 module_param(gpio_pendown, int, 0);
-MODULE_PARM_DESC(gpio_pendown, "The GPIO used to decide the pendown state (required)");
+MODULE_PARM_DESC(gpio_pendown, "The GPIO used to decide the pendown state (required unless poll is set)");
+
+static bool poll = false;
+module_param(poll, bool, 0);
+MODULE_PARM_DESC(poll, "Poll the controller instead of using the pendown interrupt");
+
+static unsigned int	poll_min_us = 5000;
+module_param(poll_min_us, uint, 0);
+MODULE_PARM_DESC(poll_min_us, "Polled mode: sample interval while touched (default=5000)");
+
+static unsigned int	poll_max_ms = 200;
+module_param(poll_max_ms, uint, 0);
+MODULE_PARM_DESC(poll_max_ms, "Polled mode: maximum idle interval, the worst case touch latency (default=200)");
+
+static unsigned int	poll_threshold = 100;
+module_param(poll_threshold, uint, 0);
+MODULE_PARM_DESC(poll_threshold, "Polled mode: minimum Z1 reading that counts as a touch (default=100)");
 
 static unsigned int	x_plate_ohms = 400;
 module_param(x_plate_ohms, uint, 0);
@@ -127,6 +164,181 @@ module_param(debounce_rep, uint, 0);
 static unsigned long irq_flags = 0;
 module_param(irq_flags, ulong, 0);
 
+static char *filter;
+module_param(filter, charp, 0);
+MODULE_PARM_DESC(filter, "Software filters to apply to x/y: median,iir,deadband (default: none -> use debounce_*)");
+
+static unsigned int	median_len = 5;
+module_param(median_len, uint, 0);
+MODULE_PARM_DESC(median_len, "Number of samples in the median window (1-9, default=5)");
+
+static unsigned int	iir_shift = 2;
+module_param(iir_shift, uint, 0);
+MODULE_PARM_DESC(iir_shift, "IIR filter strength, new = old + (sample - old) / 2^iir_shift (0-7, default=2)");
+
+static unsigned int	deadband = 4;
+module_param(deadband, uint, 0);
+MODULE_PARM_DESC(deadband, "Ignore changes smaller than or equal to this (default=4)");
+
+static unsigned int	xres = 320;
+module_param(xres, uint, 0);
+MODULE_PARM_DESC(xres, "Screen width used by the calibrated device (default=320)");
+
+static unsigned int	yres = 240;
+module_param(yres, uint, 0);
+MODULE_PARM_DESC(yres, "Screen height used by the calibrated device (default=240)");
+
+static bool latency_stats = false;
+module_param(latency_stats, bool, 0);
+MODULE_PARM_DESC(latency_stats, "Collect IRQ to input event latency statistics in debugfs");
+
+/*
+ * Software filter
+ *
+ * The filter is called by the ads7846 driver for every conversion, so
+ * instead of taking additional readings like debounce_max does, it works
+ * on the history of reported samples. A pause longer than FILTER_TIMEOUT_MS
+ * between samples means the pen has been lifted and the history is reset.
+ */
+
+#define FILTER_MEDIAN		BIT(0)
+#define FILTER_IIR		BIT(1)
+#define FILTER_DEADBAND		BIT(2)
+
+#define FILTER_MEDIAN_MAX	9
+#define FILTER_TIMEOUT_MS	50
+
+/* data_idx of the messages set up by the ads7846 driver */
+#define FILTER_IDX_Y		0
+#define FILTER_IDX_X		1
+
+struct ads7846_filter_channel {
+	int median[FILTER_MEDIAN_MAX];
+	unsigned int median_pos;
+	unsigned int median_cnt;
+	int iir;		/* scaled by 16 */
+	int last;
+	unsigned long stamp;
+	bool valid;
+};
+
+struct ads7846_filter_data {
+	unsigned int flags;
+	struct ads7846_filter_channel ch[2];
+};
+
+static unsigned int filter_flags;
+
+static int ads7846_filter_median(struct ads7846_filter_channel *ch, int val)
+{
+	int tmp[FILTER_MEDIAN_MAX];
+	int i, j, v;
+
+	ch->median[ch->median_pos] = val;
+	ch->median_pos = (ch->median_pos + 1) % median_len;
+	if (ch->median_cnt < median_len)
+		ch->median_cnt++;
+
+	/* insertion sort, the window is tiny */
+	for (i = 0; i < ch->median_cnt; i++) {
+		v = ch->median[i];
+		for (j = i; j > 0 && tmp[j - 1] > v; j--)
+			tmp[j] = tmp[j - 1];
+		tmp[j] = v;
+	}
+
+	return tmp[ch->median_cnt / 2];
+}
+
+static int ads7846_filter_init(const struct ads7846_platform_data *pdata,
+			       void **filter_data)
+{
+	struct ads7846_filter_data *data;
+
+	data = kzalloc(sizeof(*data), GFP_KERNEL);
+	if (!data)
+		return -ENOMEM;
+
+	data->flags = filter_flags;
+	*filter_data = data;
+
+	return 0;
+}
+
+static int ads7846_filter(void *filter_data, int data_idx, int *val)
+{
+	struct ads7846_filter_data *data = filter_data;
+	struct ads7846_filter_channel *ch;
+	int v = *val;
+
+	/* pressure readings are passed through */
+	if (data_idx != FILTER_IDX_X && data_idx != FILTER_IDX_Y)
+		return ADS7846_FILTER_OK;
+
+	ch = &data->ch[data_idx];
+	if (!ch->valid || time_after(jiffies, ch->stamp + msecs_to_jiffies(FILTER_TIMEOUT_MS))) {
+		ch->median_pos = 0;
+		ch->median_cnt = 0;
+		ch->iir = v << 4;
+		ch->last = v;
+		ch->valid = true;
+	}
+	ch->stamp = jiffies;
+
+	if (data->flags & FILTER_MEDIAN)
+		v = ads7846_filter_median(ch, v);
+
+	if (data->flags & FILTER_IIR) {
+		ch->iir += ((v << 4) - ch->iir) >> iir_shift;
+		v = ch->iir >> 4;
+	}
+
+	if (data->flags & FILTER_DEADBAND) {
+		if (abs(v - ch->last) <= deadband)
+			v = ch->last;
+	}
+
+	ch->last = v;
+	*val = v;
+
+	return ADS7846_FILTER_OK;
+}
+
+static void ads7846_filter_cleanup(void *filter_data)
+{
+	kfree(filter_data);
+}
+
+static int ads7846_filter_parse(void)
+{
+	char *tmp;
+
+	while ((tmp = strsep(&filter, ","))) {
+		if (strcmp(tmp, "median") == 0) {
+			filter_flags |= FILTER_MEDIAN;
+		} else if (strcmp(tmp, "iir") == 0) {
+			filter_flags |= FILTER_IIR;
+		} else if (strcmp(tmp, "deadband") == 0) {
+			filter_flags |= FILTER_DEADBAND;
+		} else if (strcmp(tmp, "none") != 0) {
+			pr_err(DRVNAME": unrecognized value in module parameter 'filter': %s\n", tmp);
+			return -EINVAL;
+		}
+	}
+
+	if (median_len < 1 || median_len > FILTER_MEDIAN_MAX) {
+		pr_err(DRVNAME": median_len must be 1-%d\n", FILTER_MEDIAN_MAX);
+		return -EINVAL;
+	}
+
+	if (iir_shift > 7) {
+		pr_err(DRVNAME": iir_shift must be 0-7\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
 
 static int spi_device_found(struct device *dev, void *data)
 {
@@ -169,19 +381,577 @@ static struct spi_board_info spi_ads7846_device = {
 
 struct spi_device *ads7846_spi_device = NULL;
 
+static bool ads7846_device_match_input(struct input_dev *dev)
+{
+	struct device *parent;
+
+	if (!ads7846_spi_device)
+		return false;
+
+	for (parent = dev->dev.parent; parent; parent = parent->parent)
+		if (parent == &ads7846_spi_device->dev)
+			return true;
+
+	return false;
+}
+
+static int ads7846_device_connect(struct input_handler *handler, struct input_dev *dev,
+				  const struct input_device_id *id)
+{
+	struct input_handle *handle;
+	int ret;
+
+	handle = kzalloc(sizeof(*handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
+
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = handler->name;
+
+	ret = input_register_handle(handle);
+	if (ret)
+		goto err_free;
+
+	ret = input_open_device(handle);
+	if (ret)
+		goto err_unregister;
+
+	if (verbose)
+		pr_info(DRVNAME": %s: connected to '%s'\n", handler->name, dev->name);
+
+	return 0;
+
+err_unregister:
+	input_unregister_handle(handle);
+err_free:
+	kfree(handle);
+	return ret;
+}
+
+static void ads7846_device_disconnect(struct input_handle *handle)
+{
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+static const struct input_device_id ads7846_device_ids[] = {
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT | INPUT_DEVICE_ID_MATCH_ABSBIT,
+		.evbit = { BIT_MASK(EV_ABS) },
+		.absbit = { [BIT_WORD(ABS_X)] = BIT_MASK(ABS_X) | BIT_MASK(ABS_Y) },
+	},
+	{ },
+};
+
+/*
+ * Calibration
+ *
+ * See touch_calib.h, the calibrated device is named after the ADS7846
+ * model and uses the pressure range from the platform data.
+ */
+
+static bool calib_match(struct input_handler *handler, struct input_dev *dev)
+{
+	return dev != calib_input && ads7846_device_match_input(dev);
+}
+
+static struct input_handler calib_handler = {
+	.filter		= calib_filter,
+	.match		= calib_match,
+	.connect	= ads7846_device_connect,
+	.disconnect	= ads7846_device_disconnect,
+	.name		= DRVNAME"-calibration",
+	.id_table	= ads7846_device_ids,
+};
+
+static char calib_name[32];
+
+/*
+ * Latency statistics
+ *
+ * See latency_stats.h, the touchscreen interrupt is timestamped through the
+ * irq_handler_entry tracepoint. In polled mode the start of a sample read
+ * takes the place of the interrupt.
+ */
+
+static int latency_irq_num;
+static struct dentry *debugfs_dir;
+
+/* the calibration filter swallows the raw events, so look at both */
+static bool latency_match(struct input_handler *handler, struct input_dev *dev)
+{
+	return (calib_input && dev == calib_input) || ads7846_device_match_input(dev);
+}
+
+static struct input_handler latency_handler = {
+	.event		= latency_input_event,
+	.match		= latency_match,
+	.connect	= ads7846_device_connect,
+	.disconnect	= ads7846_device_disconnect,
+	.name		= DRVNAME"-latency",
+	.id_table	= ads7846_device_ids,
+};
+
+static int latency_register(int irq)
+{
+	int ret;
+
+	latency_irq_num = irq;
+	ret = latency_probe_irqs(&latency_irq_num, irq > 0);
+	if (ret)
+		return ret;
+
+	ret = input_register_handler(&latency_handler);
+	if (ret) {
+		pr_err(DRVNAME": input_register_handler() returned %d\n", ret);
+		latency_unprobe_irqs();
+		return ret;
+	}
+
+	debugfs_create_file("latency", 0644, debugfs_dir, NULL, &latency_fops);
+
+	return 0;
+}
+
+static void latency_unregister(void)
+{
+	if (!latency_stats)
+		return;
+
+	input_unregister_handler(&latency_handler);
+	latency_unprobe_irqs();
+}
+/*
+ * Polled mode
+ *
+ * Without a pendown interrupt the controller is polled from a hrtimer.
+ * An idle poll is a single Z1 conversion, if it exceeds poll_threshold
+ * the panel is touched and full Y/X/Z1/Z2 samples are read every
+ * poll_min_us until Z1 drops again. While idle the interval doubles on
+ * every poll up to poll_max_ms, which bounds the touch detection latency.
+ * The SPI messages are sent with spi_async() and the samples are reported
+ * from the completion handler, so no thread is involved.
+ * Poll counts, conversions and rates are shown in
+ * /sys/kernel/debug/ads7846_device/poll. Writing to the file resets it.
+ */
+
+/* control byte, 12-bit differential conversions, see ads7846.c */
+#define ADS_START		(1 << 7)
+#define ADS_A2A1A0_d_y		(1 << 4)
+#define ADS_A2A1A0_d_z1		(3 << 4)
+#define ADS_A2A1A0_d_z2		(4 << 4)
+#define ADS_A2A1A0_d_x		(5 << 4)
+#define ADS_PD10_ADC_ON		(1 << 0)
+#define ADS_PD10_REF_ON		(2 << 0)
+#define READ_12BIT_DFR(x)	(ADS_START | ADS_A2A1A0_d_ ## x | ADS_PD10_ADC_ON | (keep_vref_on ? ADS_PD10_REF_ON : 0))
+#define ADS_PWRDOWN		(ADS_START | ADS_A2A1A0_d_y)
+
+/* 24 clocks per conversion: command byte followed by the 16-bit result */
+enum { POLL_Y, POLL_X, POLL_Z1, POLL_Z2, POLL_PWRDOWN, POLL_NUM };
+#define POLL_CONV_LEN		3
+
+struct poll_stats {
+	u64 idle_polls;
+	u64 touch_polls;
+	u64 conversions;
+	u64 errors;
+	u64 idle_ns;
+	u64 touch_ns;
+	ktime_t stamp;
+};
+
+static DEFINE_SPINLOCK(poll_lock);
+static struct poll_stats poll_stats;
+static struct input_dev *poll_input;
+static struct hrtimer poll_timer;
+static struct spi_message poll_msg;
+static struct spi_transfer poll_xfer;
+static struct completion poll_stopped;
+static u8 *poll_tx, *poll_rx;
+static void *poll_filter_data;
+static unsigned int poll_interval_us;
+static bool poll_running;
+static bool poll_touched;
+static bool poll_full;
+
+static void poll_submit(bool full);
+
+static int poll_result(int conv)
+{
+	u8 *d = poll_rx + conv * POLL_CONV_LEN;
+
+	return ((d[1] << 8 | d[2]) >> 3) & 0xfff;
+}
+
+/* called with poll_lock held */
+static void poll_account(bool touched)
+{
+	ktime_t now = ktime_get();
+	u64 delta = ktime_to_ns(ktime_sub(now, poll_stats.stamp));
+
+	if (touched)
+		poll_stats.touch_ns += delta;
+	else
+		poll_stats.idle_ns += delta;
+	poll_stats.stamp = now;
+}
+
+static bool poll_report(void)
+{
+	const struct ads7846_platform_data *pdata = &pdata_ads7846_device;
+	int x, y, z1, z2;
+	u32 Rt;
+
+	y = poll_result(POLL_Y);
+	x = poll_result(POLL_X);
+	z1 = poll_result(POLL_Z1);
+	z2 = poll_result(POLL_Z2);
+
+	if (z1 < poll_threshold || !x || z2 <= z1)
+		return false;
+
+	/* same pressure calculation as the ads7846 driver */
+	Rt = z2 - z1;
+	Rt *= x;
+	Rt *= x_plate_ohms;
+	Rt /= z1;
+	Rt = (Rt + 2047) >> 12;
+	if (Rt > pdata->pressure_max)
+		return false;
+
+	if (poll_filter_data) {
+		ads7846_filter(poll_filter_data, FILTER_IDX_Y, &y);
+		ads7846_filter(poll_filter_data, FILTER_IDX_X, &x);
+	}
+
+	if (swap_xy)
+		swap(x, y);
+
+	if (!poll_touched)
+		input_report_key(poll_input, BTN_TOUCH, 1);
+	input_report_abs(poll_input, ABS_X, x);
+	input_report_abs(poll_input, ABS_Y, y);
+	input_report_abs(poll_input, ABS_PRESSURE, pdata->pressure_max - Rt);
+	input_sync(poll_input);
+	poll_touched = true;
+
+	return true;
+}
+
+static void poll_release(void)
+{
+	if (!poll_touched)
+		return;
+
+	input_report_key(poll_input, BTN_TOUCH, 0);
+	input_report_abs(poll_input, ABS_PRESSURE, 0);
+	input_sync(poll_input);
+	poll_touched = false;
+}
+
+/* restart the timer, or tell poll_stop() that nothing is in flight */
+static void poll_next(void)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&poll_lock, flags);
+	if (poll_running)
+		hrtimer_start(&poll_timer, ns_to_ktime((u64)poll_interval_us * NSEC_PER_USEC), HRTIMER_MODE_REL);
+	else
+		complete(&poll_stopped);
+	spin_unlock_irqrestore(&poll_lock, flags);
+}
+
+static void poll_complete(void *context)
+{
+	bool was_touched = poll_touched;
+	bool touched;
+	unsigned long flags;
+
+	if (poll_msg.status) {
+		spin_lock_irqsave(&poll_lock, flags);
+		poll_stats.errors++;
+		spin_unlock_irqrestore(&poll_lock, flags);
+		poll_interval_us = poll_max_ms * USEC_PER_MSEC;
+		poll_next();
+		return;
+	}
+
+	if (poll_full) {
+		touched = poll_report();
+		if (!touched)
+			poll_release();
+	} else {
+		touched = poll_result(0) >= poll_threshold;
+	}
+
+	spin_lock_irqsave(&poll_lock, flags);
+	if (poll_full) {
+		poll_stats.touch_polls++;
+		poll_stats.conversions += POLL_PWRDOWN;
+	} else {
+		poll_stats.idle_polls++;
+		poll_stats.conversions++;
+	}
+	poll_account(was_touched);
+	spin_unlock_irqrestore(&poll_lock, flags);
+
+	/* touch detected, don't wait for the next poll */
+	if (touched && !poll_full) {
+		poll_submit(true);
+		return;
+	}
+
+	if (touched)
+		poll_interval_us = poll_min_us;
+	else
+		poll_interval_us = min_t(unsigned int, poll_interval_us * 2, poll_max_ms * USEC_PER_MSEC);
+
+	poll_next();
+}
+
+static void poll_submit(bool full)
+{
+	unsigned int len;
+	int ret;
+
+	if (full) {
+		poll_tx[POLL_Y * POLL_CONV_LEN] = READ_12BIT_DFR(y);
+		poll_tx[POLL_X * POLL_CONV_LEN] = READ_12BIT_DFR(x);
+		poll_tx[POLL_Z1 * POLL_CONV_LEN] = READ_12BIT_DFR(z1);
+		poll_tx[POLL_Z2 * POLL_CONV_LEN] = READ_12BIT_DFR(z2);
+		poll_tx[POLL_PWRDOWN * POLL_CONV_LEN] = ADS_PWRDOWN;
+		len = POLL_NUM * POLL_CONV_LEN;
+	} else {
+		/* a single Z1 conversion */
+		poll_tx[0] = READ_12BIT_DFR(z1);
+		poll_tx[POLL_CONV_LEN] = ADS_PWRDOWN;
+		len = 2 * POLL_CONV_LEN;
+	}
+	poll_full = full;
+
+	if (latency_stats && full)
+		latency_irq(0);
+
+	spi_message_init(&poll_msg);
+	poll_msg.complete = poll_complete;
+	memset(&poll_xfer, 0, sizeof(poll_xfer));
+	poll_xfer.tx_buf = poll_tx;
+	poll_xfer.rx_buf = poll_rx;
+	poll_xfer.len = len;
+	spi_message_add_tail(&poll_xfer, &poll_msg);
+
+	ret = spi_async(ads7846_spi_device, &poll_msg);
+	if (ret) {
+		poll_msg.status = ret;
+		poll_complete(NULL);
+	}
+}
+
+static enum hrtimer_restart poll_timer_func(struct hrtimer *timer)
+{
+	poll_submit(poll_touched);
+
+	return HRTIMER_NORESTART;
+}
+
+static int poll_open(struct input_dev *dev)
+{
+	unsigned long flags;
+
+	init_completion(&poll_stopped);
+	poll_interval_us = poll_min_us;
+	poll_touched = false;
+
+	spin_lock_irqsave(&poll_lock, flags);
+	poll_running = true;
+	poll_stats.stamp = ktime_get();
+	hrtimer_start(&poll_timer, ktime_set(0, 0), HRTIMER_MODE_REL);
+	spin_unlock_irqrestore(&poll_lock, flags);
+
+	return 0;
+}
+
+static void poll_close(struct input_dev *dev)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&poll_lock, flags);
+	poll_running = false;
+	spin_unlock_irqrestore(&poll_lock, flags);
+
+	/* if the timer wasn't pending, a message is in flight */
+	if (!hrtimer_cancel(&poll_timer))
+		wait_for_completion(&poll_stopped);
+
+	poll_release();
+}
+
+static int poll_show(struct seq_file *m, void *v)
+{
+	struct poll_stats s;
+	unsigned long flags;
+	u64 ns;
+
+	spin_lock_irqsave(&poll_lock, flags);
+	if (poll_running)
+		poll_account(poll_touched);
+	s = poll_stats;
+	spin_unlock_irqrestore(&poll_lock, flags);
+
+	ns = s.idle_ns + s.touch_ns;
+
+	seq_printf(m, "interval:    %u us\n", poll_interval_us);
+	seq_printf(m, "idle polls:  %llu\n", s.idle_polls);
+	seq_printf(m, "touch polls: %llu\n", s.touch_polls);
+	seq_printf(m, "conversions: %llu\n", s.conversions);
+	seq_printf(m, "errors:      %llu\n", s.errors);
+	seq_printf(m, "idle:        %llu ms\n", div_u64(s.idle_ns, NSEC_PER_MSEC));
+	seq_printf(m, "touched:     %llu ms\n", div_u64(s.touch_ns, NSEC_PER_MSEC));
+	if (s.idle_ns)
+		seq_printf(m, "idle polls/s:  %llu\n", div64_u64(s.idle_polls * NSEC_PER_SEC, s.idle_ns));
+	if (s.touch_ns)
+		seq_printf(m, "touch polls/s: %llu\n", div64_u64(s.touch_polls * NSEC_PER_SEC, s.touch_ns));
+	if (ns)
+		seq_printf(m, "conversions/s: %llu\n", div64_u64(s.conversions * NSEC_PER_SEC, ns));
+
+	return 0;
+}
+
+static int poll_debugfs_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, poll_show, NULL);
+}
+
+static ssize_t poll_write(struct file *file, const char __user *buf,
+			  size_t count, loff_t *ppos)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&poll_lock, flags);
+	memset(&poll_stats, 0, sizeof(poll_stats));
+	poll_stats.stamp = ktime_get();
+	spin_unlock_irqrestore(&poll_lock, flags);
+
+	return count;
+}
+
+static const struct file_operations poll_fops = {
+	.owner		= THIS_MODULE,
+	.open		= poll_debugfs_open,
+	.read		= seq_read,
+	.write		= poll_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int poll_register(struct ads7846_platform_data *pdata)
+{
+	static char name[32];
+	int ret;
+
+	if (pdata->model != 7846 && pdata->model != 7873) {
+		pr_err(DRVNAME": polled mode needs pressure readings (model 7846 or 7873)\n");
+		return -EINVAL;
+	}
+
+	if (!poll_min_us || poll_max_ms * USEC_PER_MSEC < poll_min_us) {
+		pr_err(DRVNAME": poll_min_us must be non-zero and not larger than poll_max_ms\n");
+		return -EINVAL;
+	}
+
+	poll_tx = kzalloc(POLL_NUM * POLL_CONV_LEN, GFP_KERNEL);
+	poll_rx = kzalloc(POLL_NUM * POLL_CONV_LEN, GFP_KERNEL);
+	if (!poll_tx || !poll_rx) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	if (filter_flags) {
+		ret = ads7846_filter_init(pdata, &poll_filter_data);
+		if (ret)
+			goto err_free;
+	}
+
+	hrtimer_init(&poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	poll_timer.function = poll_timer_func;
+
+	poll_input = input_allocate_device();
+	if (!poll_input) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	snprintf(name, sizeof(name), "ADS%d Touchscreen", pdata->model);
+	poll_input->name = name;
+	poll_input->phys = DRVNAME"/input1";
+	poll_input->id.bustype = BUS_SPI;
+	poll_input->id.product = pdata->model;
+	poll_input->dev.parent = &ads7846_spi_device->dev;
+	poll_input->open = poll_open;
+	poll_input->close = poll_close;
+
+	input_set_capability(poll_input, EV_KEY, BTN_TOUCH);
+	input_set_abs_params(poll_input, ABS_X, pdata->x_min, pdata->x_max, 0, 0);
+	input_set_abs_params(poll_input, ABS_Y, pdata->y_min, pdata->y_max, 0, 0);
+	input_set_abs_params(poll_input, ABS_PRESSURE, pdata->pressure_min, pdata->pressure_max, 0, 0);
+
+	ret = input_register_device(poll_input);
+	if (ret) {
+		pr_err(DRVNAME": input_register_device() returned %d\n", ret);
+		input_free_device(poll_input);
+		goto err_free;
+	}
+
+	debugfs_create_file("poll", 0644, debugfs_dir, NULL, &poll_fops);
+
+	return 0;
+
+err_free:
+	if (poll_filter_data)
+		ads7846_filter_cleanup(poll_filter_data);
+	poll_filter_data = NULL;
+	kfree(poll_tx);
+	kfree(poll_rx);
+	poll_input = NULL;
+	return ret;
+}
+
+static void poll_unregister(void)
+{
+	if (!poll_input)
+		return;
+
+	/* closes the device, which stops polling */
+	input_unregister_device(poll_input);
+	if (poll_filter_data)
+		ads7846_filter_cleanup(poll_filter_data);
+	poll_filter_data = NULL;
+	kfree(poll_tx);
+	kfree(poll_rx);
+	poll_input = NULL;
+}
+
 static int __init ads7846_device_init(void)
 {
 	struct spi_master *master;
 	struct ads7846_platform_data *pdata = &pdata_ads7846_device;
+	int ret;
 
 	if (verbose)
 		pr_info("\n\n"DRVNAME": %s()\n", __func__);
 
-	if (gpio_pendown < 0) {
-		pr_err(DRVNAME": Argument required: 'gpio_pendown'\n");
+	if (gpio_pendown < 0 && !poll) {
+		pr_err(DRVNAME": Argument required: 'gpio_pendown' (or 'poll')\n");
 		return -EINVAL;
 	}
 
+	ret = ads7846_filter_parse();
+	if (ret)
+		return ret;
+
 	if (verbose > 1)
 		pr_spi_devices(); /* print list of registered SPI devices */
 
@@ -190,10 +960,16 @@ static int __init ads7846_device_init(void)
 	spi_ads7846_device.bus_num = busnum;
 	spi_ads7846_device.chip_select = cs;
 	spi_ads7846_device.mode = mode;
-	irq = irq ? irq : (gpio_to_irq(gpio_pendown));
-	if(irq < 0) {
-		pr_err(DRVNAME": Unable to get IRQ assigned to gpio_pendown'\n");
-		return -EINVAL;
+	if (poll) {
+		/* keep the ads7846 driver from binding to the device */
+		strlcpy(spi_ads7846_device.modalias, DRVNAME, sizeof(spi_ads7846_device.modalias));
+		irq = 0;
+	} else {
+		irq = irq ? irq : (gpio_to_irq(gpio_pendown));
+		if(irq < 0) {
+			pr_err(DRVNAME": Unable to get IRQ assigned to gpio_pendown'\n");
+			return -EINVAL;
+		}
 	}
 
 	spi_ads7846_device.irq = irq;
@@ -220,10 +996,24 @@ static int __init ads7846_device_init(void)
 	pdata->gpio_pendown = gpio_pendown;
 	pdata->irq_flags = irq_flags;
 
+	/* the driver ignores debounce_* when a filter is set */
+	if (filter_flags && !poll) {
+		if (debounce_max)
+			pr_warning(DRVNAME": debounce_max is ignored when 'filter' is used\n");
+		pdata->filter_init = ads7846_filter_init;
+		pdata->filter = ads7846_filter;
+		pdata->filter_cleanup = ads7846_filter_cleanup;
+	}
+
 	if (verbose) {
 		pr_info(DRVNAME": Settings:\n");
 		pr_pdata(model);
 		pr_pdata(gpio_pendown);
+		if (poll) {
+			pr_info(DRVNAME":   poll_min_us = %u\n", poll_min_us);
+			pr_info(DRVNAME":   poll_max_ms = %u\n", poll_max_ms);
+			pr_info(DRVNAME":   poll_threshold = %u\n", poll_threshold);
+		}
 		pr_pdata(swap_xy);
 		pr_pdata(x_min);
 		pr_pdata(x_max);
@@ -241,6 +1031,17 @@ static int __init ads7846_device_init(void)
 		pr_pdata(debounce_max);
 		pr_pdata(debounce_tol);
 		pr_pdata(debounce_rep);
+		pr_info(DRVNAME":   filter = %s%s%s%s\n",
+			filter_flags ? "" : "none",
+			filter_flags & FILTER_MEDIAN ? "median " : "",
+			filter_flags & FILTER_IIR ? "iir " : "",
+			filter_flags & FILTER_DEADBAND ? "deadband" : "");
+		if (filter_flags & FILTER_MEDIAN)
+			pr_info(DRVNAME":   median_len = %u\n", median_len);
+		if (filter_flags & FILTER_IIR)
+			pr_info(DRVNAME":   iir_shift = %u\n", iir_shift);
+		if (filter_flags & FILTER_DEADBAND)
+			pr_info(DRVNAME":   deadband = %u\n", deadband);
 	}
 
 	master = spi_busnum_to_master(spi_ads7846_device.bus_num);
@@ -258,10 +1059,41 @@ static int __init ads7846_device_init(void)
 		return -EPERM;
 	}
 
+	debugfs_dir = debugfs_create_dir(DRVNAME, NULL);
+
+	if (poll) {
+		ret = poll_register(pdata);
+		if (ret)
+			goto err_spi;
+	}
+
+	snprintf(calib_name, sizeof(calib_name), "ADS%d Touchscreen calibrated", pdata->model);
+	ret = calib_register(&calib_handler, calib_name, pdata->model, xres, yres,
+			     pdata->pressure_min, pdata->pressure_max);
+	if (ret)
+		goto err_poll;
+
+	if (latency_stats) {
+		ret = latency_register(irq);
+		if (ret)
+			goto err_calib;
+	}
+
 	if (verbose)
 		pr_spi_devices();
 
 	return 0;
+
+err_calib:
+	calib_unregister(&calib_handler);
+err_poll:
+	poll_unregister();
+err_spi:
+	debugfs_remove_recursive(debugfs_dir);
+	device_del(&ads7846_spi_device->dev);
+	kfree(ads7846_spi_device);
+	ads7846_spi_device = NULL;
+	return ret;
 }
 
 static void __exit ads7846_device_exit(void)
@@ -269,6 +1101,11 @@ static void __exit ads7846_device_exit(void)
 	if (verbose)
 		pr_info(DRVNAME": %s()\n", __func__);
 
+	latency_unregister();
+	calib_unregister(&calib_handler);
+	poll_unregister();
+	debugfs_remove_recursive(debugfs_dir);
+
 	if (ads7846_spi_device) {
 		device_del(&ads7846_spi_device->dev);
 		kfree(ads7846_spi_device);
@@ -0,0 +1,50 @@
+/*
+ * Tracepoints for ads7846_device
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ads7846_device
+
+#if !defined(_ADS7846_DEVICE_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ADS7846_DEVICE_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(ads7846_device_irq,
+	TP_PROTO(int irq),
+	TP_ARGS(irq),
+	TP_STRUCT__entry(
+		__field(int, irq)
+	),
+	TP_fast_assign(
+		__entry->irq = irq;
+	),
+	TP_printk("irq=%d", __entry->irq)
+);
+
+/* latency_ns is -1 if the event can't be tied to an interrupt */
+TRACE_EVENT(ads7846_device_event,
+	TP_PROTO(s64 latency_ns),
+	TP_ARGS(latency_ns),
+	TP_STRUCT__entry(
+		__field(s64, latency_ns)
+	),
+	TP_fast_assign(
+		__entry->latency_ns = latency_ns;
+	),
+	TP_printk("latency_ns=%lld", __entry->latency_ns)
+);
+
+#endif /* _ADS7846_DEVICE_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ads7846_device_trace
+#include <trace/define_trace.h>
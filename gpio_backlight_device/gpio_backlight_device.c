@@ -23,6 +23,15 @@
 #include <linux/init.h>
 #include <linux/platform_device.h>
 #include <linux/platform_data/gpio_backlight.h>
+#include <linux/backlight.h>
+#include <linux/fb.h>
+#include <linux/gpio.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/spinlock.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #define DRVNAME "gpio_backlight_device"
 
@@ -41,6 +50,22 @@ MODULE_PARM_DESC(active_low, "GPIO is active low");
 static bool verbose;
 module_param(verbose, bool, 0);
 
+static bool pwm;
+module_param(pwm, bool, 0);
+MODULE_PARM_DESC(pwm, "Dim the backlight with hrtimer based software PWM");
+
+static unsigned levels = 16;
+module_param(levels, uint, 0);
+MODULE_PARM_DESC(levels, "pwm: Number of brightness levels (default: 16)");
+
+static unsigned pwm_freq = 200;
+module_param(pwm_freq, uint, 0);
+MODULE_PARM_DESC(pwm_freq, "pwm: PWM frequency in Hz (default: 200)");
+
+static unsigned fade_ms = 250;
+module_param(fade_ms, uint, 0);
+MODULE_PARM_DESC(fade_ms, "pwm: Time to fade from off to full brightness (default: 250, 0=instant)");
+
 
 static struct gpio_backlight_platform_data pdata = {
 	.name = DRVNAME,
@@ -61,6 +86,247 @@ static struct platform_device gpio_backlight_device = {
 };
 
 
+/*
+ * Software PWM
+ *
+ * A hrtimer alternates between the on and off part of each period. The
+ * timer only runs while the duty cycle is between 0% and 100% or a fade
+ * is in progress. On every period start the on time is moved towards the
+ * target so that a full fade takes fade_ms.
+ * Timer jitter and CPU time are shown in /sys/kernel/debug/gpio_backlight_device/pwm
+ */
+
+struct pwm_stats {
+	u64 callbacks;
+	u64 late_sum_ns;
+	u64 late_max_ns;
+	u64 cpu_ns;
+	ktime_t start;
+};
+
+static DEFINE_SPINLOCK(pwm_lock);
+static struct hrtimer pwm_timer;
+static struct backlight_device *pwm_bl;
+static struct dentry *debugfs_dir;
+static struct pwm_stats pwm_stats;
+static u32 pwm_period_ns;
+static u32 pwm_fade_step_ns;
+static u32 pwm_on_ns;
+static u32 pwm_target_ns;
+static bool pwm_on_phase;
+static bool pwm_running;
+
+static void pwm_gpio_set(bool on)
+{
+	gpio_set_value(gpio, on ^ active_low);
+}
+
+static enum hrtimer_restart pwm_timer_func(struct hrtimer *timer)
+{
+	ktime_t start = ktime_get();
+	enum hrtimer_restart ret = HRTIMER_RESTART;
+	u64 late = ktime_to_ns(ktime_sub(start, hrtimer_get_expires(timer)));
+	u32 next;
+
+	spin_lock(&pwm_lock);
+
+	if (pwm_on_phase) {
+		pwm_gpio_set(false);
+		pwm_on_phase = false;
+		next = pwm_period_ns - pwm_on_ns;
+	} else {
+		if (pwm_on_ns < pwm_target_ns)
+			pwm_on_ns = min(pwm_on_ns + pwm_fade_step_ns, pwm_target_ns);
+		else if (pwm_on_ns > pwm_target_ns)
+			pwm_on_ns = max(pwm_on_ns - min(pwm_fade_step_ns, pwm_on_ns), pwm_target_ns);
+
+		if (pwm_on_ns == 0 || pwm_on_ns >= pwm_period_ns) {
+			/* fully off or on, the timer is only needed while fading */
+			pwm_gpio_set(pwm_on_ns);
+			next = pwm_period_ns;
+			if (pwm_on_ns == pwm_target_ns) {
+				pwm_running = false;
+				ret = HRTIMER_NORESTART;
+			}
+		} else {
+			pwm_gpio_set(true);
+			pwm_on_phase = true;
+			next = pwm_on_ns;
+		}
+	}
+
+	pwm_stats.callbacks++;
+	pwm_stats.late_sum_ns += late;
+	pwm_stats.late_max_ns = max(pwm_stats.late_max_ns, late);
+	pwm_stats.cpu_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	spin_unlock(&pwm_lock);
+
+	if (ret == HRTIMER_RESTART) {
+		hrtimer_add_expires_ns(timer, next);
+		/* don't try to catch up if we've fallen more than a phase behind */
+		if (ktime_before(hrtimer_get_expires(timer), start))
+			hrtimer_forward_now(timer, ns_to_ktime(next));
+	}
+
+	return ret;
+}
+
+static int pwm_update_status(struct backlight_device *bl)
+{
+	int brightness = bl->props.brightness;
+	unsigned long flags;
+
+	if (bl->props.power != FB_BLANK_UNBLANK ||
+	    bl->props.fb_blank != FB_BLANK_UNBLANK)
+		brightness = 0;
+
+	spin_lock_irqsave(&pwm_lock, flags);
+	pwm_target_ns = div_u64((u64)pwm_period_ns * brightness, bl->props.max_brightness);
+	if (!fade_ms)
+		pwm_on_ns = pwm_target_ns;
+	if (!pwm_running) {
+		pwm_running = true;
+		pwm_on_phase = false;
+		hrtimer_start(&pwm_timer, ktime_set(0, 0), HRTIMER_MODE_REL);
+	}
+	spin_unlock_irqrestore(&pwm_lock, flags);
+
+	return 0;
+}
+
+static int pwm_get_brightness(struct backlight_device *bl)
+{
+	return bl->props.brightness;
+}
+
+static const struct backlight_ops pwm_backlight_ops = {
+	.options	= BL_CORE_SUSPENDRESUME,
+	.update_status	= pwm_update_status,
+	.get_brightness	= pwm_get_brightness,
+};
+
+static int pwm_show(struct seq_file *m, void *v)
+{
+	struct pwm_stats s;
+	unsigned long flags;
+	u32 on_ns;
+	u64 elapsed_ms;
+
+	spin_lock_irqsave(&pwm_lock, flags);
+	s = pwm_stats;
+	on_ns = pwm_on_ns;
+	spin_unlock_irqrestore(&pwm_lock, flags);
+
+	elapsed_ms = ktime_to_ms(ktime_sub(ktime_get(), s.start)) ? : 1;
+
+	seq_printf(m, "frequency:   %u Hz\n", pwm_freq);
+	seq_printf(m, "period:      %u ns\n", pwm_period_ns);
+	seq_printf(m, "on time:     %u ns\n", on_ns);
+	seq_printf(m, "callbacks:   %llu\n", s.callbacks);
+	if (s.callbacks) {
+		seq_printf(m, "jitter avg:  %llu ns\n", div64_u64(s.late_sum_ns, s.callbacks));
+		seq_printf(m, "jitter max:  %llu ns\n", s.late_max_ns);
+	}
+	seq_printf(m, "cpu:         %llu ns/s\n", div64_u64(s.cpu_ns * MSEC_PER_SEC, elapsed_ms));
+
+	return 0;
+}
+
+static int pwm_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, pwm_show, NULL);
+}
+
+static ssize_t pwm_write(struct file *file, const char __user *buf,
+			 size_t count, loff_t *ppos)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&pwm_lock, flags);
+	memset(&pwm_stats, 0, sizeof(pwm_stats));
+	pwm_stats.start = ktime_get();
+	spin_unlock_irqrestore(&pwm_lock, flags);
+
+	return count;
+}
+
+static const struct file_operations pwm_fops = {
+	.owner		= THIS_MODULE,
+	.open		= pwm_open,
+	.read		= seq_read,
+	.write		= pwm_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int pwm_backlight_register(void)
+{
+	struct backlight_properties props;
+	int ret;
+
+	if (levels < 2 || !pwm_freq || pwm_freq > 100000) {
+		pr_err(DRVNAME": levels must be at least 2 and pwm_freq 1-100000\n");
+		return -EINVAL;
+	}
+
+	ret = gpio_request_one(gpio, (def_value ^ active_low) ? GPIOF_OUT_INIT_HIGH : GPIOF_OUT_INIT_LOW, DRVNAME);
+	if (ret) {
+		pr_err(DRVNAME": gpio_request_one(%d) returned %d\n", gpio, ret);
+		return ret;
+	}
+
+	if (gpio_cansleep(gpio)) {
+		pr_err(DRVNAME": gpio %d can sleep and can't be used for software PWM\n", gpio);
+		ret = -EINVAL;
+		goto err_gpio;
+	}
+
+	pwm_period_ns = NSEC_PER_SEC / pwm_freq;
+	pwm_fade_step_ns = pwm_period_ns;
+	if (fade_ms)
+		pwm_fade_step_ns = max_t(u64, 1, div64_u64((u64)pwm_period_ns * pwm_period_ns,
+							   (u64)fade_ms * NSEC_PER_MSEC));
+	pwm_on_ns = def_value ? pwm_period_ns : 0;
+	pwm_target_ns = pwm_on_ns;
+	pwm_stats.start = ktime_get();
+
+	hrtimer_init(&pwm_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	pwm_timer.function = pwm_timer_func;
+
+	memset(&props, 0, sizeof(props));
+	props.type = BACKLIGHT_RAW;
+	props.max_brightness = levels - 1;
+	props.brightness = def_value ? props.max_brightness : 0;
+
+	pwm_bl = backlight_device_register(DRVNAME, NULL, NULL, &pwm_backlight_ops, &props);
+	if (IS_ERR(pwm_bl)) {
+		ret = PTR_ERR(pwm_bl);
+		pr_err(DRVNAME": backlight_device_register() returned %d\n", ret);
+		pwm_bl = NULL;
+		goto err_gpio;
+	}
+
+	debugfs_dir = debugfs_create_dir(DRVNAME, NULL);
+	debugfs_create_file("pwm", 0644, debugfs_dir, NULL, &pwm_fops);
+
+	return 0;
+
+err_gpio:
+	gpio_free(gpio);
+	return ret;
+}
+
+static void pwm_backlight_unregister(void)
+{
+	debugfs_remove_recursive(debugfs_dir);
+	backlight_device_unregister(pwm_bl);
+	hrtimer_cancel(&pwm_timer);
+	pwm_gpio_set(false);
+	gpio_free(gpio);
+}
+
+
 static int __init gpio_backlight_device_init(void)
 {
 	int ret;
@@ -77,6 +343,12 @@ static int __init gpio_backlight_device_init(void)
 #endif
 	}
 
+	if (pwm) {
+		if (verbose)
+			pr_info(DRVNAME": software PWM: %u levels, %u Hz, fade %u ms\n", levels, pwm_freq, fade_ms);
+		return pwm_backlight_register();
+	}
+
 	pdata.gpio = gpio;
 	pdata.def_value = def_value;
 	pdata.active_low = active_low;
@@ -95,7 +367,10 @@ static void __exit gpio_backlight_device_exit(void)
 	if (verbose)
 		pr_info(DRVNAME": %s()\n", __func__);
 
-	platform_device_unregister(&gpio_backlight_device);
+	if (pwm)
+		pwm_backlight_unregister();
+	else
+		platform_device_unregister(&gpio_backlight_device);
 }
 
 module_init(gpio_backlight_device_init);
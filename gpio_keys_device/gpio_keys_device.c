@@ -24,23 +24,51 @@
 #include <linux/platform_device.h>
 #include <linux/input.h>
 #include <linux/gpio_keys.h>
+#include <linux/input-polldev.h>
+#include <linux/input/matrix_keypad.h>
 #include <linux/io.h>
 #include <linux/delay.h>
+#include <linux/ctype.h>
+#include <linux/gpio.h>
+#include <linux/gpio/consumer.h>
+#include <linux/gpio/driver.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/interrupt.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/tracepoint.h>
 
 #define DRVNAME "gpio_keys_device"
 
-#define MAX_KEYS 64
+#define CREATE_TRACE_POINTS
+#include "gpio_keys_device_trace.h"
 
+#define LATENCY_TRACE_IRQ(irq)		trace_gpio_keys_device_irq(irq)
+#define LATENCY_TRACE_EVENT(ns)		trace_gpio_keys_device_event(ns)
+#include "latency_stats.h"
 
-static char *keys[MAX_KEYS] = { NULL, };
-static int keys_num = 0;
-module_param_array(keys, charp, &keys_num, 0);
-MODULE_PARM_DESC(keys, "List of keys.");
+
+static char *keys;
+module_param(keys, charp, 0);
+MODULE_PARM_DESC(keys, "List of keys. Values are numbers or a subset of the input event names: the EV_* types, the keyboard, F1-F24, keypad, navigation and media KEY_* codes, common BTN_*, SW_* and ABS_* codes. Other codes are given as numbers.");
 
 static unsigned int poll_interval = 20;
 module_param(poll_interval, int, 0);
 MODULE_PARM_DESC(poll_interval, "polling interval in msecs - for polling driver only (default=20)");
 
+static unsigned int poll_idle = 0;
+module_param(poll_idle, int, 0);
+MODULE_PARM_DESC(poll_idle, "adaptive polling: interval in msecs when idle, poll_interval is used after a key change (default=0 -> disabled)");
+
+static unsigned int poll_quiet = 1000;
+module_param(poll_quiet, int, 0);
+MODULE_PARM_DESC(poll_quiet, "adaptive polling: msecs without key changes before slowing down (default=1000)");
+
 static bool repeat = false;
 module_param(repeat, bool, 0);
 MODULE_PARM_DESC(repeat, "enable input subsystem auto repeat");
@@ -49,6 +77,10 @@ static bool polled = false;
 module_param(polled, bool, 0);
 MODULE_PARM_DESC(polled, "use polled driver: gpio_keys_polled");
 
+static bool batched = false;
+module_param(batched, bool, 0);
+MODULE_PARM_DESC(batched, "polled mode: read the keys on each gpiochip with one array read instead of using gpio_keys_polled");
+
 static bool active_low = false;
 module_param(active_low, bool, 0);
 MODULE_PARM_DESC(active_low, "Set active_low=1 as default");
@@ -73,11 +105,38 @@ static unsigned int verbose = 0;
 module_param(verbose, uint, 0);
 MODULE_PARM_DESC(verbose, "0-3");
 
+static bool latency_stats = false;
+module_param(latency_stats, bool, 0);
+MODULE_PARM_DESC(latency_stats, "Collect IRQ to input event latency statistics in debugfs");
+
+static unsigned int rows[MATRIX_MAX_ROWS];
+static int rows_num = 0;
+module_param_array(rows, uint, &rows_num, 0);
+MODULE_PARM_DESC(rows, "Matrix keypad: list of row GPIOs (enables matrix mode, keys are then row:col:code)");
+
+static unsigned int cols[MATRIX_MAX_COLS];
+static int cols_num = 0;
+module_param_array(cols, uint, &cols_num, 0);
+MODULE_PARM_DESC(cols, "Matrix keypad: list of column GPIOs");
 
-static struct gpio_keys_button gpio_keys_table[MAX_KEYS] = { };
+static unsigned int col_scan_delay_us = 20;
+module_param(col_scan_delay_us, uint, 0);
+MODULE_PARM_DESC(col_scan_delay_us, "Matrix keypad: delay in usecs after activating a column (default=20)");
 
-static struct gpio_keys_platform_data pdata = {
-        .buttons        = gpio_keys_table,
+
+static int keys_num;
+static struct gpio_keys_button *gpio_keys_table;
+
+static struct gpio_keys_platform_data pdata;
+
+static uint32_t *matrix_keymap;
+
+static struct matrix_keymap_data matrix_keymap_data;
+
+static struct matrix_keypad_platform_data matrix_pdata = {
+	.keymap_data	= &matrix_keymap_data,
+	.row_gpios	= rows,
+	.col_gpios	= cols,
 };
 
 static void pdev_release(struct device *dev);
@@ -131,6 +190,13 @@ static void gpio_pull_all(unsigned pud)
 	if (verbose > 1)
 		pr_info(DRVNAME": %s(%d)\n", __func__, pud);
 
+	if (rows_num) {
+		/* the rows are the inputs in a matrix */
+		for (i=0;i<rows_num;i++)
+			gpio_pull(rows[i], pud);
+		return;
+	}
+
 	for (i=0;i<keys_num;i++) {
 		gpio_pull(gpio_keys_table[i].gpio, pud);
 	}
@@ -151,62 +217,1009 @@ static void pdev_release(struct device *dev)
 		gpio_pull_all(0);
 }
 
-static int get_next_keys_button_value(char **str, char *name, int default_value)
+static bool gpio_keys_device_match_input(struct input_dev *dev)
+{
+	return dev->dev.parent == &gpio_keys_device.dev;
+}
+
+static int gpio_keys_device_connect(struct input_handler *handler, struct input_dev *dev,
+				    const struct input_device_id *id)
 {
-	char *p_val;
-	int val = default_value;
+	struct input_handle *handle;
 	int ret;
 
-	if (*str) {
-		p_val = strsep(str, ":");
+	handle = kzalloc(sizeof(*handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
+
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = handler->name;
+
+	ret = input_register_handle(handle);
+	if (ret)
+		goto err_free;
 
-		if (verbose > 2) {
-			printk("*str: %p,  tmp: %p\n", *str, p_val);
-			if (*str)
-				printk("*str: '%s'\n", *str);
-			if (p_val)
-				printk("p_val: '%s'\n", p_val);
+	ret = input_open_device(handle);
+	if (ret)
+		goto err_unregister;
+
+	if (verbose)
+		pr_info(DRVNAME": %s: connected to '%s'\n", handler->name, dev->name);
+
+	return 0;
+
+err_unregister:
+	input_unregister_handle(handle);
+err_free:
+	kfree(handle);
+	return ret;
+}
+
+static void gpio_keys_device_disconnect(struct input_handle *handle)
+{
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+/* matched against the device by gpio_keys_device_match_input() */
+static const struct input_device_id gpio_keys_device_ids[] = {
+	{ .driver_info = 1 },
+	{ },
+};
+
+/*
+ * Latency statistics
+ *
+ * See latency_stats.h, the key interrupts are timestamped through the
+ * irq_handler_entry tracepoint. This includes debounce_interval, and contact
+ * bounce shows up as spurious interrupts. The polled driver has no
+ * interrupts, so only events are counted.
+ */
+
+static int *latency_irqs;
+static int latency_nirqs;
+static struct dentry *debugfs_dir;
+
+static bool latency_match(struct input_handler *handler, struct input_dev *dev)
+{
+	return gpio_keys_device_match_input(dev);
+}
+
+static struct input_handler latency_handler = {
+	.event		= latency_input_event,
+	.match		= latency_match,
+	.connect	= gpio_keys_device_connect,
+	.disconnect	= gpio_keys_device_disconnect,
+	.name		= DRVNAME"-latency",
+	.id_table	= gpio_keys_device_ids,
+};
+
+static int latency_register(void)
+{
+	int ret, i, irq;
+
+	if (rows_num) {
+		/* matrix-keypad has an interrupt on each row */
+		latency_irqs = kcalloc(rows_num, sizeof(*latency_irqs), GFP_KERNEL);
+		if (!latency_irqs)
+			return -ENOMEM;
+		for (i = 0; i < rows_num; i++) {
+			irq = gpio_to_irq(rows[i]);
+			if (irq > 0)
+				latency_irqs[latency_nirqs++] = irq;
 		}
+	} else if (!polled) {
+		latency_irqs = kcalloc(pdata.nbuttons, sizeof(*latency_irqs), GFP_KERNEL);
+		if (!latency_irqs)
+			return -ENOMEM;
+		for (i = 0; i < pdata.nbuttons; i++) {
+			irq = pdata.buttons[i].irq ? : gpio_to_irq(pdata.buttons[i].gpio);
+			if (irq > 0)
+				latency_irqs[latency_nirqs++] = irq;
+		}
+	}
 
-		if (p_val) {
-			if (strlen(p_val) == 0) {
-				val = default_value;
-			} else {
-				ret = kstrtoint(p_val, 10, &val);
-				if (ret) {
-					pr_err(DRVNAME":  could not parse number in keys parameter: '%s'\n", p_val);
-					return -EINVAL;
-				}
-			}
+	ret = latency_probe_irqs(latency_irqs, latency_nirqs);
+	if (ret)
+		goto err_free;
+
+	ret = input_register_handler(&latency_handler);
+	if (ret) {
+		pr_err(DRVNAME": input_register_handler() returned %d\n", ret);
+		goto err_probe;
+	}
+
+	debugfs_create_file("latency", 0644, debugfs_dir, NULL, &latency_fops);
+
+	return 0;
+
+err_probe:
+	latency_unprobe_irqs();
+err_free:
+	kfree(latency_irqs);
+	latency_irqs = NULL;
+	latency_nirqs = 0;
+	return ret;
+}
+
+static void latency_unregister(void)
+{
+	if (!latency_stats)
+		return;
+
+	input_unregister_handler(&latency_handler);
+	latency_unprobe_irqs();
+	kfree(latency_irqs);
+	latency_irqs = NULL;
+	latency_nirqs = 0;
+}
+/*
+ * Adaptive polling
+ *
+ * The poll function of the gpio-keys-polled input_polled_dev is wrapped so
+ * the interval can be changed between polls: poll_interval is used as soon
+ * as a key changes, and after poll_quiet msecs without changes the interval
+ * is doubled on every poll until it reaches poll_idle.
+ * The input handle is never opened, so the device is still only polled
+ * while a reader has it open. Changes are found by comparing the key,
+ * switch and axis state the input core keeps before and after each poll.
+ * Statistics are in /sys/kernel/debug/gpio_keys_device/adaptive
+ */
+
+struct adaptive_stats {
+	u64 polls;
+	u64 changes;
+	u64 latency_sum_ms;
+	unsigned int latency_max_ms;
+	ktime_t start;
+};
+
+static DEFINE_SPINLOCK(adaptive_lock);
+static struct adaptive_stats adaptive;
+static struct input_polled_dev *adaptive_polldev;
+static void (*adaptive_orig_poll)(struct input_polled_dev *dev);
+static ktime_t adaptive_last_change;
+
+struct adaptive_state {
+	unsigned long key[BITS_TO_LONGS(KEY_CNT)];
+	unsigned long sw[BITS_TO_LONGS(SW_CNT)];
+	int abs[ABS_CNT];
+};
+
+/* only touched from the poll work and connect */
+static struct adaptive_state adaptive_prev, adaptive_cur;
+
+static void adaptive_save(struct input_dev *input, struct adaptive_state *st)
+{
+	int i;
+
+	memcpy(st->key, input->key, sizeof(st->key));
+	memcpy(st->sw, input->sw, sizeof(st->sw));
+	for (i = 0; i < ABS_CNT; i++)
+		st->abs[i] = input->absinfo ? input->absinfo[i].value : 0;
+}
+
+static void adaptive_poll(struct input_polled_dev *dev)
+{
+	ktime_t now = ktime_get();
+	unsigned long flags;
+	bool changed;
+
+	adaptive_orig_poll(dev);
+	adaptive_save(dev->input, &adaptive_cur);
+	changed = memcmp(&adaptive_cur, &adaptive_prev, sizeof(adaptive_cur));
+	if (changed)
+		adaptive_prev = adaptive_cur;
+
+	spin_lock_irqsave(&adaptive_lock, flags);
+	adaptive.polls++;
+	if (changed) {
+		/* the change happened at most one interval ago */
+		adaptive.changes++;
+		adaptive.latency_sum_ms += dev->poll_interval;
+		adaptive.latency_max_ms = max(adaptive.latency_max_ms, dev->poll_interval);
+	}
+	spin_unlock_irqrestore(&adaptive_lock, flags);
+
+	if (changed) {
+		adaptive_last_change = now;
+		dev->poll_interval = poll_interval;
+	} else if (dev->poll_interval < poll_idle &&
+		   ktime_to_ms(ktime_sub(now, adaptive_last_change)) > poll_quiet) {
+		dev->poll_interval = min(dev->poll_interval * 2, poll_idle);
+	}
+}
+
+static bool adaptive_match(struct input_handler *handler, struct input_dev *dev)
+{
+	return gpio_keys_device_match_input(dev);
+}
+
+static int adaptive_connect(struct input_handler *handler, struct input_dev *dev,
+			    const struct input_device_id *id)
+{
+	struct input_polled_dev *polldev = input_get_drvdata(dev);
+	struct input_handle *handle;
+	unsigned long flags;
+	int ret;
+
+	handle = kzalloc(sizeof(*handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
+
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = handler->name;
+
+	/* not opened, that would start the polling */
+	ret = input_register_handle(handle);
+	if (ret) {
+		kfree(handle);
+		return ret;
+	}
+
+	spin_lock_irqsave(&adaptive_lock, flags);
+	memset(&adaptive, 0, sizeof(adaptive));
+	adaptive.start = ktime_get();
+	spin_unlock_irqrestore(&adaptive_lock, flags);
+
+	adaptive_last_change = ktime_get();
+	adaptive_save(dev, &adaptive_prev);
+	adaptive_orig_poll = polldev->poll;
+	adaptive_polldev = polldev;
+	polldev->poll = adaptive_poll;
+
+	return 0;
+}
+
+static void adaptive_disconnect(struct input_handle *handle)
+{
+	if (adaptive_polldev) {
+		adaptive_polldev->poll = adaptive_orig_poll;
+		adaptive_polldev = NULL;
+	}
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+static struct input_handler adaptive_handler = {
+	.match		= adaptive_match,
+	.connect	= adaptive_connect,
+	.disconnect	= adaptive_disconnect,
+	.name		= DRVNAME"-adaptive",
+	.id_table	= gpio_keys_device_ids,
+};
+
+static int adaptive_show(struct seq_file *m, void *v)
+{
+	struct adaptive_stats s;
+	unsigned long flags;
+	u64 elapsed, rate;
+	u32 frac;
+
+	spin_lock_irqsave(&adaptive_lock, flags);
+	s = adaptive;
+	spin_unlock_irqrestore(&adaptive_lock, flags);
+
+	elapsed = ktime_to_ms(ktime_sub(ktime_get(), s.start)) ? : 1;
+	rate = div_u64_rem(div64_u64(s.polls * 100000, elapsed), 100, &frac);
+
+	seq_printf(m, "interval:      %u ms\n", adaptive_polldev ? adaptive_polldev->poll_interval : 0);
+	seq_printf(m, "polls:         %llu\n", s.polls);
+	seq_printf(m, "wakeups/s:     %llu.%02u\n", rate, frac);
+	seq_printf(m, "changes:       %llu\n", s.changes);
+	if (s.changes) {
+		seq_printf(m, "latency avg:   <= %llu ms\n", div64_u64(s.latency_sum_ms, s.changes));
+		seq_printf(m, "latency max:   <= %u ms\n", s.latency_max_ms);
+	}
+
+	return 0;
+}
+
+static int adaptive_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, adaptive_show, NULL);
+}
+
+static ssize_t adaptive_write(struct file *file, const char __user *buf,
+			      size_t count, loff_t *ppos)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&adaptive_lock, flags);
+	memset(&adaptive, 0, sizeof(adaptive));
+	adaptive.start = ktime_get();
+	spin_unlock_irqrestore(&adaptive_lock, flags);
+
+	return count;
+}
+
+static const struct file_operations adaptive_fops = {
+	.owner		= THIS_MODULE,
+	.open		= adaptive_open,
+	.read		= seq_read,
+	.write		= adaptive_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int adaptive_register(void)
+{
+	int ret;
+
+	ret = input_register_handler(&adaptive_handler);
+	if (ret) {
+		pr_err(DRVNAME": input_register_handler() returned %d\n", ret);
+		return ret;
+	}
+
+	debugfs_create_file("adaptive", 0644, debugfs_dir, NULL, &adaptive_fops);
+
+	return 0;
+}
+
+static void adaptive_unregister(void)
+{
+	if (!polled || !poll_idle)
+		return;
+
+	input_unregister_handler(&adaptive_handler);
+}
+
+/*
+ * Batched polling
+ *
+ * gpio-keys-polled reads every button with its own GPIO access. With
+ * batched=1 the polled input device is set up here instead: the buttons
+ * are sorted by gpiochip, each chip's buttons are read with one
+ * gpiod_get_array_value_cansleep() per poll, and the levels are then
+ * debounced and reported like gpio-keys-polled does. The platform device
+ * is registered without a driver to bind, but it's still the parent of
+ * the input device, so latency statistics and adaptive polling work too.
+ * On the Raspberry Pi a get_multiple operation is added to the SoC gpiochip
+ * if it doesn't have one, reading the level register once per bank.
+ *
+ * Writing to /sys/kernel/debug/gpio_keys_device/batch_bench times a poll
+ * with per-key and array reads for 8, 32 and 64 keys, made up by repeating
+ * the configured buttons. Reading the file shows the result.
+ */
+
+#define BATCH_BENCH_LOOPS	1000
+
+struct batch_key {
+	struct gpio_keys_button *button;
+	struct gpio_desc *desc;
+	int state;
+	int count;
+	int threshold;
+};
+
+struct batch_bench_result {
+	int keys;
+	u64 single_ns;
+	u64 array_ns;
+};
+
+static const int batch_bench_keys[] = { 8, 32, 64 };
+
+static DEFINE_MUTEX(batch_bench_lock);
+static struct batch_bench_result batch_bench[ARRAY_SIZE(batch_bench_keys)];
+static struct input_polled_dev *batch_polldev;
+static struct batch_key *batch_keys;
+static struct gpio_desc **batch_descs;
+static int *batch_values;
+
+#if defined(CONFIG_ARCH_BCM2708) || defined(CONFIG_ARCH_BCM2709)
+
+#define GPIO_LEV0 13
+
+static u32 __iomem *batch_soc_regs;
+static struct gpio_chip *batch_soc_chip;
+
+static int batch_soc_get_multiple(struct gpio_chip *chip, unsigned long *mask,
+				  unsigned long *bits)
+{
+	unsigned int shift;
+	int bank;
+	u32 m;
+
+	for (bank = 0; bank < DIV_ROUND_UP(chip->ngpio, 32); bank++) {
+		shift = (bank * 32) % BITS_PER_LONG;
+		m = mask[BIT_WORD(bank * 32)] >> shift;
+		if (!m)
+			continue;
+		bits[BIT_WORD(bank * 32)] &= ~((unsigned long)m << shift);
+		bits[BIT_WORD(bank * 32)] |= (unsigned long)(readl(batch_soc_regs + GPIO_LEV0 + bank) & m) << shift;
+	}
+
+	return 0;
+}
+
+static int batch_soc_match(struct gpio_chip *chip, void *data)
+{
+	return chip->label && (!strcmp(chip->label, "pinctrl-bcm2835") ||
+			       !strcmp(chip->label, "bcm2708_gpio"));
+}
+
+static void batch_soc_register(void)
+{
+	struct gpio_chip *chip;
+
+	chip = gpiochip_find(NULL, batch_soc_match);
+	if (!chip || chip->get_multiple)
+		return;
+
+	batch_soc_regs = ioremap(BCM2708_PERI_BASE + 0x200000, SZ_16K);
+	if (!batch_soc_regs)
+		return;
+
+	chip->get_multiple = batch_soc_get_multiple;
+	batch_soc_chip = chip;
+
+	if (verbose)
+		pr_info(DRVNAME": added get_multiple to gpiochip %d-%d\n",
+			chip->base, chip->base + chip->ngpio - 1);
+}
+
+static void batch_soc_unregister(void)
+{
+	if (!batch_soc_chip)
+		return;
+
+	batch_soc_chip->get_multiple = NULL;
+	batch_soc_chip = NULL;
+	iounmap(batch_soc_regs);
+}
+#else
+static void batch_soc_register(void) { }
+static void batch_soc_unregister(void) { }
+#endif
+
+/* one array read for each run of descriptors on the same chip */
+static void batch_read(struct gpio_desc **descs, int *values, int n)
+{
+	struct gpio_chip *chip;
+	int i, start;
+
+	for (start = 0; start < n; start = i) {
+		chip = gpiod_to_chip(descs[start]);
+		for (i = start + 1; i < n && gpiod_to_chip(descs[i]) == chip; i++)
+			;
+		gpiod_get_array_value_cansleep(i - start, descs + start, values + start);
+	}
+}
+
+static void batch_poll(struct input_polled_dev *dev)
+{
+	struct input_dev *input = dev->input;
+	struct gpio_keys_button *button;
+	struct batch_key *key;
+	bool sync = false;
+	int i, state;
+
+	batch_read(batch_descs, batch_values, keys_num);
+
+	for (i = 0; i < keys_num; i++) {
+		key = &batch_keys[i];
+		button = key->button;
+		state = !!batch_values[i] ^ button->active_low;
+		if (state == key->state) {
+			key->count = 0;
+			continue;
+		}
+		if (++key->count < key->threshold)
+			continue;
+
+		key->state = state;
+		key->count = 0;
+		if (button->type == EV_ABS) {
+			if (state)
+				input_event(input, EV_ABS, button->code, button->value);
+		} else {
+			input_event(input, button->type ?: EV_KEY, button->code, state);
+		}
+		sync = true;
+	}
+
+	if (sync)
+		input_sync(input);
+}
+
+static int batch_key_cmp(const void *a, const void *b)
+{
+	const struct batch_key *ka = a, *kb = b;
+	struct gpio_chip *ca = gpiod_to_chip(ka->desc);
+	struct gpio_chip *cb = gpiod_to_chip(kb->desc);
+
+	if (ca != cb)
+		return ca < cb ? -1 : 1;
+
+	return desc_to_gpio(ka->desc) - desc_to_gpio(kb->desc);
+}
+
+static int batch_bench_show(struct seq_file *m, void *v)
+{
+	struct batch_bench_result r[ARRAY_SIZE(batch_bench)];
+	int i;
+
+	mutex_lock(&batch_bench_lock);
+	memcpy(r, batch_bench, sizeof(r));
+	mutex_unlock(&batch_bench_lock);
+
+	if (!r[0].keys) {
+		seq_puts(m, "write to the file to run the benchmark\n");
+		return 0;
+	}
+
+	seq_puts(m, "keys  per-key ns/poll  array ns/poll\n");
+	for (i = 0; i < ARRAY_SIZE(r); i++)
+		seq_printf(m, "%4d  %15llu  %13llu\n", r[i].keys,
+			   div_u64(r[i].single_ns, BATCH_BENCH_LOOPS),
+			   div_u64(r[i].array_ns, BATCH_BENCH_LOOPS));
+
+	return 0;
+}
+
+static int batch_bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, batch_bench_show, NULL);
+}
+
+static ssize_t batch_bench_write(struct file *file, const char __user *buf,
+				 size_t count, loff_t *ppos)
+{
+	struct gpio_desc **descs;
+	ktime_t start;
+	int *values;
+	int i, j, k, n;
+
+	n = batch_bench_keys[ARRAY_SIZE(batch_bench_keys) - 1];
+	descs = kcalloc(n, sizeof(*descs), GFP_KERNEL);
+	values = kcalloc(n, sizeof(*values), GFP_KERNEL);
+	if (!descs || !values) {
+		kfree(descs);
+		kfree(values);
+		return -ENOMEM;
+	}
+
+	mutex_lock(&batch_bench_lock);
+	for (k = 0; k < ARRAY_SIZE(batch_bench_keys); k++) {
+		n = batch_bench_keys[k];
+		/* repeat the buttons, keeping them sorted by chip */
+		for (i = 0; i < n; i++)
+			descs[i] = batch_descs[i * keys_num / n];
+
+		start = ktime_get();
+		for (j = 0; j < BATCH_BENCH_LOOPS; j++)
+			for (i = 0; i < n; i++)
+				values[i] = gpiod_get_value_cansleep(descs[i]);
+		batch_bench[k].single_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+		start = ktime_get();
+		for (j = 0; j < BATCH_BENCH_LOOPS; j++)
+			batch_read(descs, values, n);
+		batch_bench[k].array_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+		batch_bench[k].keys = n;
+	}
+	mutex_unlock(&batch_bench_lock);
+
+	kfree(descs);
+	kfree(values);
+
+	return count;
+}
+
+static const struct file_operations batch_bench_fops = {
+	.owner		= THIS_MODULE,
+	.open		= batch_bench_open,
+	.read		= seq_read,
+	.write		= batch_bench_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void batch_free(void)
+{
+	int i;
+
+	if (batch_keys) {
+		for (i = 0; i < keys_num; i++)
+			if (batch_keys[i].desc)
+				gpio_free(batch_keys[i].button->gpio);
+	}
+	kfree(batch_keys);
+	batch_keys = NULL;
+	kfree(batch_descs);
+	batch_descs = NULL;
+	kfree(batch_values);
+	batch_values = NULL;
+}
+
+static int batch_register(void)
+{
+	struct gpio_keys_button *button;
+	struct input_dev *input;
+	struct batch_key *key;
+	int i, ret;
+
+	batch_keys = kcalloc(keys_num, sizeof(*batch_keys), GFP_KERNEL);
+	batch_descs = kcalloc(keys_num, sizeof(*batch_descs), GFP_KERNEL);
+	batch_values = kcalloc(keys_num, sizeof(*batch_values), GFP_KERNEL);
+	if (!batch_keys || !batch_descs || !batch_values) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	for (i = 0; i < keys_num; i++) {
+		button = &gpio_keys_table[i];
+		key = &batch_keys[i];
+		ret = gpio_request_one(button->gpio, GPIOF_IN, button->desc ? : DRVNAME);
+		if (ret) {
+			pr_err(DRVNAME": failed to request gpio %d: %d\n", button->gpio, ret);
+			goto err_free;
 		}
+		key->button = button;
+		key->desc = gpio_to_desc(button->gpio);
+		key->threshold = DIV_ROUND_UP(button->debounce_interval, poll_interval);
+	}
+	sort(batch_keys, keys_num, sizeof(*batch_keys), batch_key_cmp, NULL);
+	for (i = 0; i < keys_num; i++)
+		batch_descs[i] = batch_keys[i].desc;
+
+	batch_soc_register();
+
+	batch_polldev = input_allocate_polled_device();
+	if (!batch_polldev) {
+		ret = -ENOMEM;
+		goto err_soc;
+	}
+	batch_polldev->poll = batch_poll;
+	batch_polldev->poll_interval = poll_interval;
+
+	input = batch_polldev->input;
+	input->name = DRVNAME;
+	input->phys = DRVNAME"/input0";
+	input->id.bustype = BUS_HOST;
+	input->dev.parent = &gpio_keys_device.dev;
+	if (repeat)
+		__set_bit(EV_REP, input->evbit);
+
+	for (i = 0; i < keys_num; i++) {
+		button = &gpio_keys_table[i];
+		if (button->type == EV_ABS)
+			input_set_abs_params(input, button->code,
+					     min(input_abs_get_min(input, button->code), button->value),
+					     max(input_abs_get_max(input, button->code), button->value),
+					     0, 0);
+		else
+			input_set_capability(input, button->type ?: EV_KEY, button->code);
+	}
+
+	/* start from the current levels */
+	batch_read(batch_descs, batch_values, keys_num);
+	for (i = 0; i < keys_num; i++)
+		batch_keys[i].state = !!batch_values[i] ^ batch_keys[i].button->active_low;
+
+	ret = input_register_polled_device(batch_polldev);
+	if (ret) {
+		pr_err(DRVNAME": input_register_polled_device() returned %d\n", ret);
+		goto err_input;
 	}
 
+	debugfs_create_file("batch_bench", 0644, debugfs_dir, NULL, &batch_bench_fops);
+
 	if (verbose)
-		pr_info(DRVNAME":   %s = %d\n", name, val);
+		pr_info(DRVNAME": batched polling of %d keys\n", keys_num);
+
+	return 0;
+
+err_input:
+	input_free_polled_device(batch_polldev);
+	batch_polldev = NULL;
+err_soc:
+	batch_soc_unregister();
+err_free:
+	batch_free();
+	return ret;
+}
+
+static void batch_unregister(void)
+{
+	if (!batch_polldev)
+		return;
 
-	return val;
+	input_unregister_polled_device(batch_polldev);
+	input_free_polled_device(batch_polldev);
+	batch_polldev = NULL;
+	batch_soc_unregister();
+	batch_free();
+}
+
+/*
+ * keys parser
+ *
+ * Each entry is a list of ':' separated fields, given either by position
+ * or as name=value. A positional field following a named one gets the next
+ * position. Values are decimal numbers or one of the names in keys_symbols.
+ *   keys=4:KEY_UP,17:code=KEY_ENTER:debounce_interval=10
+ * keys_symbols is not the whole of input-event-codes.h, only the codes a
+ * GPIO button is likely to send. Other codes are given as numbers.
+ */
+
+#define SYM(x)	{ #x, x }
+
+static const struct {
+	const char *name;
+	int value;
+} keys_symbols[] __initconst = {
+	SYM(EV_KEY), SYM(EV_REL), SYM(EV_ABS), SYM(EV_SW),
+
+	SYM(KEY_ESC), SYM(KEY_1), SYM(KEY_2), SYM(KEY_3), SYM(KEY_4),
+	SYM(KEY_5), SYM(KEY_6), SYM(KEY_7), SYM(KEY_8), SYM(KEY_9),
+	SYM(KEY_0), SYM(KEY_MINUS), SYM(KEY_EQUAL), SYM(KEY_BACKSPACE),
+	SYM(KEY_TAB), SYM(KEY_Q), SYM(KEY_W), SYM(KEY_E), SYM(KEY_R),
+	SYM(KEY_T), SYM(KEY_Y), SYM(KEY_U), SYM(KEY_I), SYM(KEY_O),
+	SYM(KEY_P), SYM(KEY_ENTER), SYM(KEY_LEFTCTRL), SYM(KEY_A),
+	SYM(KEY_S), SYM(KEY_D), SYM(KEY_F), SYM(KEY_G), SYM(KEY_H),
+	SYM(KEY_J), SYM(KEY_K), SYM(KEY_L), SYM(KEY_LEFTSHIFT), SYM(KEY_Z),
+	SYM(KEY_X), SYM(KEY_C), SYM(KEY_V), SYM(KEY_B), SYM(KEY_N),
+	SYM(KEY_M), SYM(KEY_COMMA), SYM(KEY_DOT), SYM(KEY_SLASH),
+	SYM(KEY_RIGHTSHIFT), SYM(KEY_LEFTALT), SYM(KEY_SPACE),
+	SYM(KEY_F1), SYM(KEY_F2), SYM(KEY_F3), SYM(KEY_F4), SYM(KEY_F5),
+	SYM(KEY_F6), SYM(KEY_F7), SYM(KEY_F8), SYM(KEY_F9), SYM(KEY_F10),
+	SYM(KEY_F11), SYM(KEY_F12), SYM(KEY_F13), SYM(KEY_F14), SYM(KEY_F15),
+	SYM(KEY_F16), SYM(KEY_F17), SYM(KEY_F18), SYM(KEY_F19), SYM(KEY_F20),
+	SYM(KEY_F21), SYM(KEY_F22), SYM(KEY_F23), SYM(KEY_F24),
+	SYM(KEY_RIGHTCTRL), SYM(KEY_RIGHTALT),
+	SYM(KEY_HOME), SYM(KEY_UP), SYM(KEY_PAGEUP), SYM(KEY_LEFT),
+	SYM(KEY_RIGHT), SYM(KEY_END), SYM(KEY_DOWN), SYM(KEY_PAGEDOWN),
+	SYM(KEY_INSERT), SYM(KEY_DELETE), SYM(KEY_MUTE), SYM(KEY_VOLUMEDOWN),
+	SYM(KEY_VOLUMEUP), SYM(KEY_POWER), SYM(KEY_PAUSE), SYM(KEY_STOP),
+	SYM(KEY_MENU), SYM(KEY_SLEEP), SYM(KEY_WAKEUP), SYM(KEY_BACK),
+	SYM(KEY_FORWARD), SYM(KEY_NEXTSONG), SYM(KEY_PLAYPAUSE),
+	SYM(KEY_PREVIOUSSONG), SYM(KEY_STOPCD), SYM(KEY_HOMEPAGE),
+	SYM(KEY_REFRESH), SYM(KEY_EXIT), SYM(KEY_PLAY), SYM(KEY_SEARCH),
+	SYM(KEY_OK), SYM(KEY_SELECT),
+
+	SYM(KEY_KP0), SYM(KEY_KP1), SYM(KEY_KP2), SYM(KEY_KP3), SYM(KEY_KP4),
+	SYM(KEY_KP5), SYM(KEY_KP6), SYM(KEY_KP7), SYM(KEY_KP8), SYM(KEY_KP9),
+	SYM(KEY_KPMINUS), SYM(KEY_KPPLUS), SYM(KEY_KPDOT), SYM(KEY_KPENTER),
+	SYM(KEY_KPSLASH), SYM(KEY_KPASTERISK), SYM(KEY_KPEQUAL),
+
+	SYM(BTN_0), SYM(BTN_1), SYM(BTN_2), SYM(BTN_3), SYM(BTN_4),
+	SYM(BTN_5), SYM(BTN_6), SYM(BTN_7), SYM(BTN_8), SYM(BTN_9),
+	SYM(BTN_LEFT), SYM(BTN_RIGHT), SYM(BTN_MIDDLE), SYM(BTN_A),
+	SYM(BTN_B), SYM(BTN_C), SYM(BTN_X), SYM(BTN_Y), SYM(BTN_Z),
+	SYM(BTN_TL), SYM(BTN_TR), SYM(BTN_SELECT), SYM(BTN_START),
+	SYM(BTN_MODE), SYM(BTN_TRIGGER), SYM(BTN_THUMB),
+
+	SYM(SW_LID), SYM(SW_TABLET_MODE), SYM(SW_HEADPHONE_INSERT),
+	SYM(SW_RFKILL_ALL), SYM(SW_DOCK), SYM(SW_LINEOUT_INSERT),
+
+	SYM(ABS_X), SYM(ABS_Y), SYM(ABS_Z), SYM(ABS_RX), SYM(ABS_RY),
+	SYM(ABS_HAT0X), SYM(ABS_HAT0Y),
+};
+
+static int __init keys_parse_value(const char *str, int *val)
+{
+	int i;
+
+	if (isdigit(*str) || *str == '-')
+		return kstrtoint(str, 10, val);
+
+	for (i = 0; i < ARRAY_SIZE(keys_symbols); i++) {
+		if (!strcmp(str, keys_symbols[i].name)) {
+			*val = keys_symbols[i].value;
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * Parse one keys entry into vals[], which holds the defaults on entry.
+ * Empty fields keep the default.
+ */
+static int __init keys_parse_entry(char *str, const char * const *fields,
+				   int num_fields, int *vals)
+{
+	char *field, *eq;
+	int pos = 0;
+	int i;
+
+	while ((field = strsep(&str, ":"))) {
+		eq = strchr(field, '=');
+		if (eq) {
+			*eq++ = '\0';
+			for (pos = 0; pos < num_fields; pos++)
+				if (!strcmp(field, fields[pos]))
+					break;
+			if (pos == num_fields) {
+				pr_err(DRVNAME":  unknown field in keys parameter: '%s'\n", field);
+				return -EINVAL;
+			}
+			field = eq;
+		}
+
+		if (pos >= num_fields) {
+			pr_err(DRVNAME":  too many fields in keys parameter: '%s'\n", field);
+			return -EINVAL;
+		}
+
+		if (*field && keys_parse_value(field, &vals[pos])) {
+			pr_err(DRVNAME":  could not parse %s in keys parameter: '%s'\n", fields[pos], field);
+			return -EINVAL;
+		}
+		pos++;
+	}
+
+	if (verbose) {
+		for (i = 0; i < num_fields; i++)
+			pr_info(DRVNAME":   %s = %d\n", fields[i], vals[i]);
+	}
+
+	return 0;
+}
+
+enum {
+	KEY_FIELD_GPIO,
+	KEY_FIELD_CODE,
+	KEY_FIELD_TYPE,
+	KEY_FIELD_ACTIVE_LOW,
+	KEY_FIELD_DEBOUNCE_INTERVAL,
+	KEY_FIELD_CAN_DISABLE,
+	KEY_FIELD_VALUE,
+	KEY_FIELD_WAKEUP,
+	KEY_FIELD_IRQ,
+	KEY_FIELD_NUM,
+};
+
+static const char * const key_fields[KEY_FIELD_NUM] __initconst = {
+	"gpio", "code", "type", "active_low", "debounce_interval",
+	"can_disable", "value", "wakeup", "irq",
+};
+
+static int __init parse_keys(char *str)
+{
+	int vals[KEY_FIELD_NUM];
+	struct gpio_keys_button *button;
+	char *p;
+	int ret, i = 0;
+
+	while ((p = strsep(&str, ","))) {
+		if (verbose)
+			pr_info(DRVNAME": Key: '%s'\n", p);
+
+		vals[KEY_FIELD_GPIO] = -1;
+		vals[KEY_FIELD_CODE] = -1;
+		vals[KEY_FIELD_TYPE] = type;
+		vals[KEY_FIELD_ACTIVE_LOW] = active_low;
+		vals[KEY_FIELD_DEBOUNCE_INTERVAL] = debounce_interval;
+		vals[KEY_FIELD_CAN_DISABLE] = 0;
+		vals[KEY_FIELD_VALUE] = 0;
+		vals[KEY_FIELD_WAKEUP] = 0;
+		vals[KEY_FIELD_IRQ] = 0;
+
+		ret = keys_parse_entry(p, key_fields, KEY_FIELD_NUM, vals);
+		if (ret)
+			return ret;
+
+		if (vals[KEY_FIELD_GPIO] < 0 || vals[KEY_FIELD_CODE] < 0) {
+			pr_err(DRVNAME":  gpio and code are required in keys parameter\n");
+			return -EINVAL;
+		}
+
+		button = &gpio_keys_table[i++];
+		button->gpio = vals[KEY_FIELD_GPIO];
+		button->code = vals[KEY_FIELD_CODE];
+		button->type = vals[KEY_FIELD_TYPE];
+		button->active_low = vals[KEY_FIELD_ACTIVE_LOW];
+		button->debounce_interval = vals[KEY_FIELD_DEBOUNCE_INTERVAL];
+		button->can_disable = vals[KEY_FIELD_CAN_DISABLE];
+		button->value = vals[KEY_FIELD_VALUE];
+		button->wakeup = vals[KEY_FIELD_WAKEUP];
+		button->irq = vals[KEY_FIELD_IRQ];
+	}
+
+	return 0;
+}
+
+enum {
+	MATRIX_FIELD_ROW,
+	MATRIX_FIELD_COL,
+	MATRIX_FIELD_CODE,
+	MATRIX_FIELD_NUM,
+};
+
+static const char * const matrix_fields[MATRIX_FIELD_NUM] __initconst = {
+	"row", "col", "code",
+};
+
+static int __init parse_matrix_keys(char *str)
+{
+	int vals[MATRIX_FIELD_NUM];
+	char *p;
+	int ret, i = 0;
+
+	while ((p = strsep(&str, ","))) {
+		if (verbose)
+			pr_info(DRVNAME": Key: '%s'\n", p);
+
+		vals[MATRIX_FIELD_ROW] = -1;
+		vals[MATRIX_FIELD_COL] = -1;
+		vals[MATRIX_FIELD_CODE] = -1;
+
+		ret = keys_parse_entry(p, matrix_fields, MATRIX_FIELD_NUM, vals);
+		if (ret)
+			return ret;
+
+		if (vals[MATRIX_FIELD_ROW] < 0 || vals[MATRIX_FIELD_ROW] >= rows_num ||
+		    vals[MATRIX_FIELD_COL] < 0 || vals[MATRIX_FIELD_COL] >= cols_num ||
+		    vals[MATRIX_FIELD_CODE] < 0) {
+			pr_err(DRVNAME":  key outside the matrix or missing code in keys parameter\n");
+			return -EINVAL;
+		}
+
+		matrix_keymap[i++] = KEY(vals[MATRIX_FIELD_ROW], vals[MATRIX_FIELD_COL],
+					 vals[MATRIX_FIELD_CODE]);
+	}
+
+	return 0;
+}
+
+static void gpio_keys_device_free(void)
+{
+	kfree(gpio_keys_table);
+	gpio_keys_table = NULL;
+	kfree(matrix_keymap);
+	matrix_keymap = NULL;
 }
 
 static int __init gpio_keys_device_init(void)
 {
-	int ret, i;
+	int ret;
 	char *p;
 
-	if (polled)
+	if (rows_num)
+		gpio_keys_device.name = "matrix-keypad";
+	else if (polled && batched)
+		gpio_keys_device.name = DRVNAME;	/* the polling is done here */
+	else if (polled)
 		gpio_keys_device.name = "gpio-keys-polled";
 	else
 		gpio_keys_device.name = "gpio-keys";
 
+	if (rows_num && (!cols_num || polled)) {
+		pr_err(DRVNAME":  matrix mode needs 'cols' and can't be polled\n");
+		return -EINVAL;
+	}
+
+	if (batched && (!polled || rows_num)) {
+		pr_err(DRVNAME":  batched needs polled and doesn't support matrix mode\n");
+		return -EINVAL;
+	}
+
 	if (pullup && pulldown) {
 		pr_err(DRVNAME":  can't have both pullup and pulldown\n");
 		return -EINVAL;
 	}
 
+	if (poll_idle && poll_idle < poll_interval) {
+		pr_err(DRVNAME":  poll_idle can't be less than poll_interval\n");
+		return -EINVAL;
+	}
+
 	if (verbose) {
 		pr_info("\n\n"DRVNAME": %s()\n", __func__);
 		pr_info(DRVNAME":   driver: %s\n", gpio_keys_device.name);
 		if (polled)
-			pr_info(DRVNAME":   poll_interval = %d\n", poll_interval);
+			pr_info(DRVNAME":   poll_interval = %d%s\n", poll_interval,
+				batched ? ", batched" : "");
+		if (polled && poll_idle)
+			pr_info(DRVNAME":   poll_idle = %d, poll_quiet = %d\n", poll_idle, poll_quiet);
 		pr_info(DRVNAME":   repeat = %s\n", repeat ? "yes" : "no");
 	}
 
@@ -214,87 +1227,90 @@ static int __init gpio_keys_device_init(void)
 		pr_info(DRVNAME":   Internal pull resistor: %s\n", pullup ? "up" : "down");
 
 	/* parse module parameter: keys */
-	if (keys_num == 0) {
+	if (!keys || !*keys) {
 		pr_err(DRVNAME":  required 'keys' parameter missing\n");
 		return -EINVAL;
 	}
-	if (keys_num > MAX_KEYS) {
-		pr_err(DRVNAME":  keys parameter: exceeded max array size: %d\n", MAX_KEYS);
-		return -EINVAL;
-	}
-	for (i=0;i<keys_num;i++) {
-		if (strchr(keys[i], ':') == NULL) {
-			pr_err(DRVNAME":  error missing ':' in keys parameter: %s\n", keys[i]);
-			return -EINVAL;
-		}
-		p = keys[i];
-		if (verbose)
-			pr_info(DRVNAME": Key: '%s'\n", p);
-		/* gpio */
-		ret = get_next_keys_button_value(&p, "gpio", -1);
-		if (ret < 0)
-			return -EINVAL;
-		gpio_keys_table[i].gpio = ret;
-		/* input event code (KEY_*, SW_*) */
-		ret = get_next_keys_button_value(&p, "code", -1);
-		if (ret < 0)
-			return -EINVAL;
-		gpio_keys_table[i].code = ret;
-		/* input event type (EV_KEY, EV_SW, EV_ABS) */
-		ret = get_next_keys_button_value(&p, "type", type);
-		if (ret < 0)
-			return -EINVAL;
-		gpio_keys_table[i].type = ret;
-		/* active_low */
-		ret = get_next_keys_button_value(&p, "active_low", active_low);
-		if (ret < 0)
-			return -EINVAL;
-		gpio_keys_table[i].active_low = ret;
-		/* debounce_interval */
-		ret = get_next_keys_button_value(&p, "debounce_interval", debounce_interval);
-		if (ret < 0)
-			return -EINVAL;
-		gpio_keys_table[i].debounce_interval = ret;
-		/* can_disable */
-		ret = get_next_keys_button_value(&p, "can_disable", 0);
-		if (ret < 0)
-			return -EINVAL;
-		gpio_keys_table[i].can_disable = ret;
-		/* axis value for EV_ABS */
-		ret = get_next_keys_button_value(&p, "value", 0);
-		if (ret < 0)
-			return -EINVAL;
-		gpio_keys_table[i].value = ret;
-		/* wakeup */
-		ret = get_next_keys_button_value(&p, "wakeup", 0);
-		if (ret < 0)
-			return -EINVAL;
-		gpio_keys_table[i].wakeup = ret;
-		/* irq */
-		ret = get_next_keys_button_value(&p, "irq", 0);
-		if (ret < 0)
-			return -EINVAL;
-		gpio_keys_table[i].irq = ret;
+	keys_num = 1;
+	for (p = keys; *p; p++)
+		if (*p == ',')
+			keys_num++;
 
-		if (p != NULL) {
-			pr_err(DRVNAME":  unparsed part in keys parameter: '%s'\n", p);
-			return -EINVAL;
-		}
+	if (rows_num) {
+		matrix_keymap = kcalloc(keys_num, sizeof(*matrix_keymap), GFP_KERNEL);
+		if (!matrix_keymap)
+			return -ENOMEM;
+		ret = parse_matrix_keys(keys);
+	} else {
+		gpio_keys_table = kcalloc(keys_num, sizeof(*gpio_keys_table), GFP_KERNEL);
+		if (!gpio_keys_table)
+			return -ENOMEM;
+		ret = parse_keys(keys);
+	}
+	if (ret) {
+		gpio_keys_device_free();
+		return ret;
 	}
+
 	pdata.buttons        = gpio_keys_table;
 	pdata.nbuttons       = keys_num;
 	pdata.poll_interval  = poll_interval;
 
+	if (rows_num) {
+		matrix_keymap_data.keymap = matrix_keymap;
+		matrix_keymap_data.keymap_size = keys_num;
+		matrix_pdata.num_row_gpios = rows_num;
+		matrix_pdata.num_col_gpios = cols_num;
+		matrix_pdata.active_low = active_low;
+		matrix_pdata.debounce_ms = debounce_interval;
+		matrix_pdata.col_scan_delay_us = col_scan_delay_us;
+		matrix_pdata.no_autorepeat = !repeat;
+		gpio_keys_device.dev.platform_data = &matrix_pdata;
+		if (verbose)
+			pr_info(DRVNAME":   matrix: %d rows, %d cols, %d keys\n", rows_num, cols_num, keys_num);
+	}
+
 	if (pullup || pulldown)
 		gpio_pull_all(pulldown ? 1 : 2);
 
 	ret = platform_device_register(&gpio_keys_device);
 	if (ret < 0) {
 		pr_err(DRVNAME":    platform_device_register() returned %d\n", ret);
+		gpio_keys_device_free();
 		return ret;
 	}
 
+	debugfs_dir = debugfs_create_dir(DRVNAME, NULL);
+
+	if (batched) {
+		ret = batch_register();
+		if (ret)
+			goto err_debugfs;
+	}
+
+	if (latency_stats) {
+		ret = latency_register();
+		if (ret)
+			goto err_batch;
+	}
+
+	if (polled && poll_idle) {
+		ret = adaptive_register();
+		if (ret)
+			goto err_latency;
+	}
+
 	return 0;
+
+err_latency:
+	latency_unregister();
+err_batch:
+	batch_unregister();
+err_debugfs:
+	debugfs_remove_recursive(debugfs_dir);
+	platform_device_unregister(&gpio_keys_device);
+	gpio_keys_device_free();
+	return ret;
 }
 
 static void __exit gpio_keys_device_exit(void)
@@ -302,7 +1318,12 @@ static void __exit gpio_keys_device_exit(void)
 	if (verbose)
 		pr_info(DRVNAME": %s()\n", __func__);
 
+	adaptive_unregister();
+	latency_unregister();
+	batch_unregister();
+	debugfs_remove_recursive(debugfs_dir);
 	platform_device_unregister(&gpio_keys_device);
+	gpio_keys_device_free();
 }
 
 module_init(gpio_keys_device_init);
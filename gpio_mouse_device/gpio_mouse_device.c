@@ -25,9 +25,26 @@
 #include <linux/gpio_mouse.h>
 #include <linux/io.h>
 #include <linux/delay.h>
+#include <linux/gpio.h>
+#include <linux/input.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/interrupt.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #define DRVNAME "gpio_mouse_device"
 
+#define CREATE_TRACE_POINTS
+#include "gpio_mouse_device_trace.h"
+
+#define LATENCY_TRACE_IRQ(irq)		trace_gpio_mouse_device_irq(irq)
+#define LATENCY_TRACE_EVENT(ns)		trace_gpio_mouse_device_event(ns)
+#include "latency_stats.h"
+
 
 static int scan_ms = 10;
 module_param(scan_ms, int, 0);
@@ -77,6 +94,26 @@ static unsigned int verbose = 0;
 module_param(verbose, uint, 0);
 MODULE_PARM_DESC(verbose, "0-1");
 
+static bool latency_stats = false;
+module_param(latency_stats, bool, 0);
+MODULE_PARM_DESC(latency_stats, "Collect GPIO edge to input event latency statistics in debugfs");
+
+static bool irq_mode = false;
+module_param(irq_mode, bool, 0);
+MODULE_PARM_DESC(irq_mode, "Use edge interrupts instead of the polling gpio_mouse driver");
+
+static int motion_ms = 10;
+module_param(motion_ms, int, 0);
+MODULE_PARM_DESC(motion_ms, "irq_mode: interval in ms between motion reports while a direction is held (default=10)");
+
+static int accel_ms = 100;
+module_param(accel_ms, int, 0);
+MODULE_PARM_DESC(accel_ms, "irq_mode: the step grows by one every accel_ms while held (default=100, 0=no acceleration)");
+
+static int accel_max = 8;
+module_param(accel_max, int, 0);
+MODULE_PARM_DESC(accel_max, "irq_mode: maximum step per motion report (default=8)");
+
 
 static void pdev_release(struct device *dev);
 
@@ -154,6 +191,374 @@ static void pdev_release(struct device *dev)
 		gpio_pull_all(0);
 }
 
+static struct input_dev *irq_input;
+
+static bool gpio_mouse_device_match_input(struct input_dev *dev)
+{
+	if (irq_mode)
+		return dev == irq_input;
+
+	return dev->dev.parent == &gpio_mouse_device.dev;
+}
+
+static int gpio_mouse_device_connect(struct input_handler *handler, struct input_dev *dev,
+				     const struct input_device_id *id)
+{
+	struct input_handle *handle;
+	int ret;
+
+	handle = kzalloc(sizeof(*handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
+
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = handler->name;
+
+	ret = input_register_handle(handle);
+	if (ret)
+		goto err_free;
+
+	ret = input_open_device(handle);
+	if (ret)
+		goto err_unregister;
+
+	if (verbose)
+		pr_info(DRVNAME": %s: connected to '%s'\n", handler->name, dev->name);
+
+	return 0;
+
+err_unregister:
+	input_unregister_handle(handle);
+err_free:
+	kfree(handle);
+	return ret;
+}
+
+static void gpio_mouse_device_disconnect(struct input_handle *handle)
+{
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+/* matched against the device by gpio_mouse_device_match_input() */
+static const struct input_device_id gpio_mouse_device_ids[] = {
+	{ .driver_info = 1 },
+	{ },
+};
+
+/*
+ * Latency statistics
+ *
+ * See latency_stats.h. The gpio_mouse driver polls the pins, so edge
+ * interrupts are requested on them just to timestamp the changes. Expect
+ * values up to scan_ms. In irq_mode the module's own handler is used.
+ */
+
+static int *latency_pins[] = { &up, &down, &left, &right, &bleft, &bmiddle, &bright };
+static int latency_irqs[ARRAY_SIZE(latency_pins)];
+static struct dentry *debugfs_dir;
+
+static irqreturn_t latency_gpio_irq(int irq, void *dev_id)
+{
+	latency_irq(irq);
+
+	return IRQ_HANDLED;
+}
+
+static bool latency_match(struct input_handler *handler, struct input_dev *dev)
+{
+	return gpio_mouse_device_match_input(dev);
+}
+
+static struct input_handler latency_handler = {
+	.event		= latency_input_event,
+	.match		= latency_match,
+	.connect	= gpio_mouse_device_connect,
+	.disconnect	= gpio_mouse_device_disconnect,
+	.name		= DRVNAME"-latency",
+	.id_table	= gpio_mouse_device_ids,
+};
+
+static void latency_free_irqs(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(latency_irqs); i++) {
+		if (latency_irqs[i] > 0)
+			free_irq(latency_irqs[i], NULL);
+		latency_irqs[i] = 0;
+	}
+}
+
+static int latency_register(void)
+{
+	int ret, i, irq;
+
+	/* irq_mode calls latency_irq() from its own handler */
+	for (i = 0; i < ARRAY_SIZE(latency_pins) && !irq_mode; i++) {
+		if (*latency_pins[i] < 0)
+			continue;
+		irq = gpio_to_irq(*latency_pins[i]);
+		if (irq < 0) {
+			pr_err(DRVNAME": gpio_to_irq(%d) returned %d\n", *latency_pins[i], irq);
+			ret = irq;
+			goto err_irqs;
+		}
+		ret = request_irq(irq, latency_gpio_irq, IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING, DRVNAME, NULL);
+		if (ret) {
+			pr_err(DRVNAME": request_irq(%d) returned %d\n", irq, ret);
+			goto err_irqs;
+		}
+		latency_irqs[i] = irq;
+	}
+
+	ret = input_register_handler(&latency_handler);
+	if (ret) {
+		pr_err(DRVNAME": input_register_handler() returned %d\n", ret);
+		goto err_irqs;
+	}
+
+	debugfs_create_file("latency", 0644, debugfs_dir, NULL, &latency_fops);
+
+	return 0;
+
+err_irqs:
+	latency_free_irqs();
+	return ret;
+}
+
+static void latency_unregister(void)
+{
+	if (!latency_stats)
+		return;
+
+	input_unregister_handler(&latency_handler);
+	latency_free_irqs();
+}
+
+/*
+ * Interrupt driven mode
+ *
+ * Edge interrupts on all pins keep track of which directions are held.
+ * Buttons are reported right away, while motion is reported from a hrtimer
+ * that only runs as long as a direction is held. Edges arriving within one
+ * motion_ms period are coalesced into a single report. The step starts at 1
+ * and grows by one every accel_ms up to accel_max.
+ */
+
+struct irq_mode_pin {
+	int *gpio;
+	unsigned int type;
+	unsigned int code;
+	int irq;
+	bool requested;
+};
+
+enum { DIR_UP, DIR_DOWN, DIR_LEFT, DIR_RIGHT };
+
+static struct irq_mode_pin irq_mode_pins[] = {
+	{ &up,		EV_REL, DIR_UP },
+	{ &down,	EV_REL, DIR_DOWN },
+	{ &left,	EV_REL, DIR_LEFT },
+	{ &right,	EV_REL, DIR_RIGHT },
+	{ &bleft,	EV_KEY, BTN_LEFT },
+	{ &bmiddle,	EV_KEY, BTN_MIDDLE },
+	{ &bright,	EV_KEY, BTN_RIGHT },
+};
+
+static struct hrtimer motion_timer;
+static unsigned long motion_held;
+static ktime_t motion_start;
+
+static void motion_report(void)
+{
+	s64 held = 0;
+	int dx = 0, dy = 0;
+	int step;
+
+	if (accel_ms > 0)
+		held = div_s64(ktime_to_ms(ktime_sub(ktime_get(), motion_start)), accel_ms);
+	step = min_t(s64, 1 + held, accel_max);
+
+	if (test_bit(DIR_UP, &motion_held))
+		dy -= step;
+	if (test_bit(DIR_DOWN, &motion_held))
+		dy += step;
+	if (test_bit(DIR_LEFT, &motion_held))
+		dx -= step;
+	if (test_bit(DIR_RIGHT, &motion_held))
+		dx += step;
+
+	input_report_rel(irq_input, REL_X, dx);
+	input_report_rel(irq_input, REL_Y, dy);
+	input_sync(irq_input);
+}
+
+static enum hrtimer_restart motion_timer_func(struct hrtimer *timer)
+{
+	if (!motion_held)
+		return HRTIMER_NORESTART;
+
+	motion_report();
+	hrtimer_forward_now(timer, ms_to_ktime(motion_ms));
+
+	return HRTIMER_RESTART;
+}
+
+static irqreturn_t irq_mode_handler(int irq, void *dev_id)
+{
+	struct irq_mode_pin *pin = dev_id;
+	int gpio = *pin->gpio;
+	bool active;
+
+	if (latency_stats)
+		latency_irq(irq);
+
+	/* request_any_context_irq() gives us a thread if the gpio can sleep */
+	active = !!(gpio_cansleep(gpio) ? gpio_get_value_cansleep(gpio) : gpio_get_value(gpio));
+	if (polarity)
+		active = !active;
+
+	if (pin->type == EV_KEY) {
+		input_report_key(irq_input, pin->code, active);
+		input_sync(irq_input);
+		return IRQ_HANDLED;
+	}
+
+	if (!active) {
+		clear_bit(pin->code, &motion_held);
+		return IRQ_HANDLED;
+	}
+
+	if (test_and_set_bit(pin->code, &motion_held))
+		return IRQ_HANDLED;
+
+	/* first direction pressed: move now, then continue from the timer */
+	if (!(motion_held & ~BIT(pin->code))) {
+		motion_start = ktime_get();
+		motion_report();
+		hrtimer_start(&motion_timer, ms_to_ktime(motion_ms), HRTIMER_MODE_REL);
+	}
+
+	return IRQ_HANDLED;
+}
+
+static void irq_mode_free(void)
+{
+	struct irq_mode_pin *pin;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(irq_mode_pins); i++) {
+		pin = &irq_mode_pins[i];
+		if (pin->irq > 0)
+			free_irq(pin->irq, pin);
+		pin->irq = 0;
+		if (pin->requested)
+			gpio_free(*pin->gpio);
+		pin->requested = false;
+	}
+	hrtimer_cancel(&motion_timer);
+}
+
+static void irq_mode_unregister(void)
+{
+	irq_mode_free();
+	input_unregister_device(irq_input);
+	irq_input = NULL;
+}
+
+static int irq_mode_register(void)
+{
+	struct irq_mode_pin *pin;
+	int ret, irq, i;
+
+	if (motion_ms < 1 || accel_max < 1) {
+		pr_err(DRVNAME":  motion_ms and accel_max must be positive\n");
+		return -EINVAL;
+	}
+
+	hrtimer_init(&motion_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	motion_timer.function = motion_timer_func;
+
+	irq_input = input_allocate_device();
+	if (!irq_input)
+		return -ENOMEM;
+
+	irq_input->name = "gpio_mouse";
+	irq_input->phys = DRVNAME"/input0";
+	irq_input->id.bustype = BUS_HOST;
+
+	input_set_capability(irq_input, EV_REL, REL_X);
+	input_set_capability(irq_input, EV_REL, REL_Y);
+
+	for (i = 0; i < ARRAY_SIZE(irq_mode_pins); i++) {
+		pin = &irq_mode_pins[i];
+		if (*pin->gpio < 0)
+			continue;
+		if (pin->type == EV_KEY)
+			input_set_capability(irq_input, EV_KEY, pin->code);
+
+		ret = gpio_request_one(*pin->gpio, GPIOF_IN, DRVNAME);
+		if (ret) {
+			pr_err(DRVNAME":  gpio_request_one(%d) returned %d\n", *pin->gpio, ret);
+			goto err_free;
+		}
+		pin->requested = true;
+	}
+
+	ret = input_register_device(irq_input);
+	if (ret) {
+		pr_err(DRVNAME":  input_register_device() returned %d\n", ret);
+		goto err_free;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(irq_mode_pins); i++) {
+		pin = &irq_mode_pins[i];
+		if (!pin->requested)
+			continue;
+		irq = gpio_to_irq(*pin->gpio);
+		if (irq < 0) {
+			pr_err(DRVNAME":  gpio_to_irq(%d) returned %d\n", *pin->gpio, irq);
+			ret = irq;
+			goto err_unregister;
+		}
+		ret = request_any_context_irq(irq, irq_mode_handler,
+					      IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING,
+					      DRVNAME, pin);
+		if (ret < 0) {
+			pr_err(DRVNAME":  request_any_context_irq(%d) returned %d\n", irq, ret);
+			goto err_unregister;
+		}
+		pin->irq = irq;
+	}
+
+	return 0;
+
+err_unregister:
+	irq_mode_unregister();
+	return ret;
+
+err_free:
+	irq_mode_free();
+	input_free_device(irq_input);
+	irq_input = NULL;
+	return ret;
+}
+
+static void gpio_mouse_device_unregister(void)
+{
+	if (irq_mode) {
+		irq_mode_unregister();
+		/* pdev_release() does this for the platform device */
+		if (pullup || pulldown)
+			gpio_pull_all(0);
+	} else {
+		platform_device_unregister(&gpio_mouse_device);
+	}
+}
+
 static int __init gpio_mouse_device_init(void)
 {
 	int ret;
@@ -181,6 +586,12 @@ static int __init gpio_mouse_device_init(void)
 	pdata.bright = bright;
 
 	if (verbose) {
+		pr_info(DRVNAME":   irq_mode: %s\n", irq_mode ? "yes" : "no");
+		if (irq_mode) {
+			pr_info(DRVNAME":   motion_ms: %d\n", motion_ms);
+			pr_info(DRVNAME":   accel_ms:  %d\n", accel_ms);
+			pr_info(DRVNAME":   accel_max: %d\n", accel_max);
+		}
 		pr_info(DRVNAME":   scan_ms:  %d\n", scan_ms);
 		pr_info(DRVNAME":   polarity: %d\n", polarity);
 		pr_info(DRVNAME":   up:       %d\n", up);
@@ -195,10 +606,30 @@ static int __init gpio_mouse_device_init(void)
 	if (pullup || pulldown)
 		gpio_pull_all(pulldown ? 1 : 2);
 
-	ret = platform_device_register(&gpio_mouse_device);
-	if (ret < 0) {
-		pr_err(DRVNAME":    platform_device_register() returned %d\n", ret);
-		return ret;
+	if (irq_mode) {
+		ret = irq_mode_register();
+		if (ret) {
+			if (pullup || pulldown)
+				gpio_pull_all(0);
+			return ret;
+		}
+	} else {
+		ret = platform_device_register(&gpio_mouse_device);
+		if (ret < 0) {
+			pr_err(DRVNAME":    platform_device_register() returned %d\n", ret);
+			return ret;
+		}
+	}
+
+	debugfs_dir = debugfs_create_dir(DRVNAME, NULL);
+
+	if (latency_stats) {
+		ret = latency_register();
+		if (ret) {
+			debugfs_remove_recursive(debugfs_dir);
+			gpio_mouse_device_unregister();
+			return ret;
+		}
 	}
 
 	return 0;
@@ -209,7 +640,9 @@ static void __exit gpio_mouse_device_exit(void)
 	if (verbose)
 		pr_info(DRVNAME": %s()\n", __func__);
 
-	platform_device_unregister(&gpio_mouse_device);
+	latency_unregister();
+	debugfs_remove_recursive(debugfs_dir);
+	gpio_mouse_device_unregister();
 }
 
 module_init(gpio_mouse_device_init);
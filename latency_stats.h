@@ -0,0 +1,212 @@
+/*
+ * IRQ to input event latency statistics for the *_device modules
+ *
+ * The time from an interrupt to the next SYN_REPORT is collected in a log2
+ * histogram and shown in /sys/kernel/debug/<module>/latency. Writing to the
+ * file resets it. An interrupt that is followed by another one before an
+ * event is counted as spurious.
+ *
+ * The including module defines DRVNAME and the LATENCY_TRACE_IRQ(irq) and
+ * LATENCY_TRACE_EVENT(ns) tracepoint calls, and registers an input handler
+ * with latency_input_event() as its event callback. The interrupts are
+ * timestamped with latency_irq(), either from the module's own handler or
+ * through latency_probe_irqs() which hooks the irq_handler_entry tracepoint.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _LATENCY_STATS_H
+#define _LATENCY_STATS_H
+
+#include <linux/kernel.h>
+#include <linux/input.h>
+#include <linux/interrupt.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+#include <linux/tracepoint.h>
+
+#define LATENCY_BUCKETS		24
+
+struct latency_stats {
+	u64 irqs;
+	u64 events;
+	u64 spurious;
+	u64 samples;
+	u64 sum_ns;
+	u64 min_ns;
+	u64 max_ns;
+	u64 hist[LATENCY_BUCKETS];
+	ktime_t irq_time;
+	bool pending;
+};
+
+static DEFINE_SPINLOCK(latency_lock);
+static struct latency_stats latency;
+static const int *latency_probe_irq_list;
+static int latency_probe_nirqs;
+static struct tracepoint *irq_entry_tp;
+
+static void latency_irq(int irq)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&latency_lock, flags);
+	latency.irqs++;
+	/* the previous interrupt didn't produce an event */
+	if (latency.pending)
+		latency.spurious++;
+	latency.irq_time = ktime_get();
+	latency.pending = true;
+	spin_unlock_irqrestore(&latency_lock, flags);
+
+	LATENCY_TRACE_IRQ(irq);
+}
+
+static void latency_event(void)
+{
+	unsigned long flags;
+	unsigned int bucket;
+	s64 ns = -1;
+	u64 delta;
+
+	spin_lock_irqsave(&latency_lock, flags);
+	latency.events++;
+	if (latency.pending) {
+		delta = ktime_to_ns(ktime_sub(ktime_get(), latency.irq_time));
+		bucket = min_t(unsigned int, fls64(div_u64(delta, NSEC_PER_USEC)), LATENCY_BUCKETS - 1);
+		latency.hist[bucket]++;
+		latency.samples++;
+		latency.sum_ns += delta;
+		if (!latency.min_ns || delta < latency.min_ns)
+			latency.min_ns = delta;
+		if (delta > latency.max_ns)
+			latency.max_ns = delta;
+		latency.pending = false;
+		ns = delta;
+	}
+	spin_unlock_irqrestore(&latency_lock, flags);
+
+	LATENCY_TRACE_EVENT(ns);
+}
+
+static void latency_input_event(struct input_handle *handle, unsigned int type,
+				unsigned int code, int value)
+{
+	if (type == EV_SYN && code == SYN_REPORT)
+		latency_event();
+}
+
+static int latency_show(struct seq_file *m, void *v)
+{
+	struct latency_stats s;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&latency_lock, flags);
+	s = latency;
+	spin_unlock_irqrestore(&latency_lock, flags);
+
+	seq_printf(m, "irqs:     %llu\n", s.irqs);
+	seq_printf(m, "events:   %llu\n", s.events);
+	seq_printf(m, "spurious: %llu\n", s.spurious);
+	if (s.samples) {
+		seq_printf(m, "min:      %llu us\n", div_u64(s.min_ns, NSEC_PER_USEC));
+		seq_printf(m, "avg:      %llu us\n", div_u64(div64_u64(s.sum_ns, s.samples), NSEC_PER_USEC));
+		seq_printf(m, "max:      %llu us\n", div_u64(s.max_ns, NSEC_PER_USEC));
+	}
+
+	seq_puts(m, "\nirq -> event latency:\n");
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		if (s.hist[i])
+			seq_printf(m, "  < %8llu us: %llu\n", 1ULL << i, s.hist[i]);
+	}
+
+	return 0;
+}
+
+static int latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, latency_show, NULL);
+}
+
+static ssize_t latency_write(struct file *file, const char __user *buf,
+			     size_t count, loff_t *ppos)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&latency_lock, flags);
+	memset(&latency, 0, sizeof(latency));
+	spin_unlock_irqrestore(&latency_lock, flags);
+
+	return count;
+}
+
+static const struct file_operations latency_fops = {
+	.owner		= THIS_MODULE,
+	.open		= latency_open,
+	.read		= seq_read,
+	.write		= latency_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void latency_irq_probe(void *data, int irq, struct irqaction *action)
+{
+	int i;
+
+	for (i = 0; i < latency_probe_nirqs; i++) {
+		if (irq == latency_probe_irq_list[i]) {
+			latency_irq(irq);
+			return;
+		}
+	}
+}
+
+static void latency_find_tracepoint(struct tracepoint *tp, void *priv)
+{
+	if (!strcmp(tp->name, "irq_handler_entry"))
+		irq_entry_tp = tp;
+}
+
+/* irqs has to stay around until latency_unprobe_irqs(), nothing is done if nirqs is 0 */
+static inline int latency_probe_irqs(const int *irqs, int nirqs)
+{
+	int ret;
+
+	if (!nirqs)
+		return 0;
+
+	latency_probe_irq_list = irqs;
+	latency_probe_nirqs = nirqs;
+	for_each_kernel_tracepoint(latency_find_tracepoint, NULL);
+	if (!irq_entry_tp) {
+		pr_err(DRVNAME": tracepoint irq_handler_entry not found\n");
+		return -ENODEV;
+	}
+	ret = tracepoint_probe_register(irq_entry_tp, latency_irq_probe, NULL);
+	if (ret) {
+		pr_err(DRVNAME": tracepoint_probe_register() returned %d\n", ret);
+		irq_entry_tp = NULL;
+		return ret;
+	}
+
+	return 0;
+}
+
+static inline void latency_unprobe_irqs(void)
+{
+	if (irq_entry_tp) {
+		tracepoint_probe_unregister(irq_entry_tp, latency_irq_probe, NULL);
+		tracepoint_synchronize_unregister();
+		irq_entry_tp = NULL;
+	}
+	latency_probe_irq_list = NULL;
+	latency_probe_nirqs = 0;
+}
+
+#endif
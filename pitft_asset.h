@@ -0,0 +1,96 @@
+/*
+ * PiTFT asset pack format
+ *
+ * Written by pitft_pack, read by pitft_test through mmap.
+ *
+ * The pack starts with a header followed by an index of assets, the image
+ * data follows. An image is a sequence of records, each starting with a
+ * 16-bit count in host byte order:
+ *   bit 15 set:   a run, count & 0x7FFF pixels of the one pixel that follows
+ *   bit 15 clear: count literal pixels follow
+ * Pixels are RGB565 big endian, the byte order the controller expects, so
+ * literal pixels can be sent straight from the mapping.
+ *
+ * BSD License
+ *
+ */
+
+#ifndef PITFT_ASSET_H
+#define PITFT_ASSET_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define PITFT_PACK_MAGIC "PTPK"
+#define PITFT_PACK_VERSION 1
+#define PITFT_ASSET_NAME_LEN 24
+
+#define PITFT_RLE_RUN 0x8000
+#define PITFT_RLE_MAX 0x7FFF
+
+struct pitft_pack_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t count;
+};
+
+struct pitft_asset {
+	char name[PITFT_ASSET_NAME_LEN];
+	uint16_t width;
+	uint16_t height;
+	uint32_t offset;	/* from the start of the pack */
+	uint32_t size;
+};
+
+/*
+ * returns the index after checking the header and that every entry has a
+ * size and its data inside the pack, NULL if the pack is broken
+ */
+static inline const struct pitft_asset *pitft_pack_index(const void *pack, size_t size)
+{
+	const struct pitft_pack_header *hdr = pack;
+	const struct pitft_asset *asset = (const void *)(hdr + 1);
+	uint64_t data;
+	uint32_t i;
+
+	if (size < sizeof(*hdr) || memcmp(hdr->magic, PITFT_PACK_MAGIC, 4) ||
+	    hdr->version != PITFT_PACK_VERSION)
+		return NULL;
+	data = sizeof(*hdr) + (uint64_t)hdr->count * sizeof(*asset);
+	if (size < data)
+		return NULL;
+
+	for (i = 0; i < hdr->count; i++) {
+		if (!asset[i].width || !asset[i].height || asset[i].offset < data ||
+		    (uint64_t)asset[i].offset + asset[i].size > size)
+			return NULL;
+	}
+
+	return asset;
+}
+
+/* returns the asset index entry, NULL if not found or the pack is broken */
+static inline const struct pitft_asset *pitft_asset_find(const void *pack, size_t size,
+							  const char *name)
+{
+	const struct pitft_pack_header *hdr = pack;
+	const struct pitft_asset *asset = (const void *)(hdr + 1);
+	uint32_t i;
+
+	if (size < sizeof(*hdr) || memcmp(hdr->magic, PITFT_PACK_MAGIC, 4) ||
+	    hdr->version != PITFT_PACK_VERSION ||
+	    size < sizeof(*hdr) + (uint64_t)hdr->count * sizeof(*asset))
+		return NULL;
+
+	for (i = 0; i < hdr->count; i++, asset++) {
+		if (strncmp(asset->name, name, PITFT_ASSET_NAME_LEN))
+			continue;
+		if ((uint64_t)asset->offset + asset->size > size)
+			return NULL;
+		return asset;
+	}
+
+	return NULL;
+}
+
+#endif
@@ -0,0 +1,219 @@
+/*
+ * PiTFT asset packer
+ *
+ * Packs binary PPM (P6) images into a run-length encoded RGB565 asset pack
+ * for pitft_test, see pitft_asset.h for the format. The asset name is the
+ * file name without directory and extension.
+ *
+ * Build: gcc -Wall -o pitft_pack pitft_pack.c
+ * Usage: pitft_pack out.pak image.ppm [image.ppm ...]
+ *
+ * BSD License
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pitft_asset.h"
+
+/* runs shorter than this are cheaper as literals */
+#define MIN_RUN 3
+
+struct image {
+	int width, height;
+	uint16_t *pixels;	/* RGB565 */
+};
+
+int ppm_token(FILE *f)
+{
+	int c, val = 0;
+
+	do {
+		c = fgetc(f);
+		if (c == '#')
+			while (c != '\n' && c != EOF)
+				c = fgetc(f);
+	} while (c == ' ' || c == '\t' || c == '\n' || c == '\r');
+
+	if (c < '0' || c > '9')
+		return -1;
+	while (c >= '0' && c <= '9') {
+		val = val * 10 + c - '0';
+		c = fgetc(f);
+	}
+
+	return val;
+}
+
+int ppm_read(const char *path, struct image *img)
+{
+	unsigned char rgb[3];
+	int i, maxval;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	if (fgetc(f) != 'P' || fgetc(f) != '6') {
+		fprintf(stderr, "%s: not a binary PPM\n", path);
+		goto err;
+	}
+	img->width = ppm_token(f);
+	img->height = ppm_token(f);
+	maxval = ppm_token(f);
+	if (img->width <= 0 || img->height <= 0 || img->width > 0xFFFF ||
+	    img->height > 0xFFFF || maxval != 255) {
+		fprintf(stderr, "%s: unsupported PPM\n", path);
+		goto err;
+	}
+
+	img->pixels = malloc(img->width * img->height * sizeof(uint16_t));
+	if (!img->pixels)
+		goto err;
+	for (i = 0; i < img->width * img->height; i++) {
+		if (fread(rgb, 3, 1, f) != 1) {
+			fprintf(stderr, "%s: short read\n", path);
+			free(img->pixels);
+			goto err;
+		}
+		img->pixels[i] = (rgb[0] >> 3) << 11 | (rgb[1] >> 2) << 5 | rgb[2] >> 3;
+	}
+	fclose(f);
+
+	return 0;
+
+err:
+	fclose(f);
+	return -1;
+}
+
+void put_pixel(unsigned char **out, uint16_t pixel)
+{
+	*(*out)++ = pixel >> 8;
+	*(*out)++ = pixel & 0xFF;
+}
+
+void put_count(unsigned char **out, uint16_t count)
+{
+	memcpy(*out, &count, 2);
+	*out += 2;
+}
+
+/* out needs room for the worst case, one literal record per MAX pixels */
+size_t rle_encode(const uint16_t *px, int n, unsigned char *start)
+{
+	unsigned char *out = start;
+	int i = 0, run, lit;
+
+	while (i < n) {
+		for (run = 1; i + run < n && run < PITFT_RLE_MAX && px[i + run] == px[i]; run++)
+			;
+		if (run >= MIN_RUN) {
+			put_count(&out, PITFT_RLE_RUN | run);
+			put_pixel(&out, px[i]);
+			i += run;
+			continue;
+		}
+
+		/* literals up to the next run worth encoding */
+		for (lit = 0; i + lit < n && lit < PITFT_RLE_MAX; lit++) {
+			if (i + lit + MIN_RUN <= n && px[i + lit] == px[i + lit + 1] &&
+			    px[i + lit] == px[i + lit + 2])
+				break;
+		}
+		put_count(&out, lit);
+		while (lit--)
+			put_pixel(&out, px[i++]);
+	}
+
+	return out - start;
+}
+
+void asset_name(const char *path, char *name)
+{
+	const char *base = strrchr(path, '/');
+	const char *dot;
+
+	base = base ? base + 1 : path;
+	dot = strrchr(base, '.');
+	memset(name, 0, PITFT_ASSET_NAME_LEN);
+	strncpy(name, base, dot && dot - base < PITFT_ASSET_NAME_LEN ?
+			    dot - base : PITFT_ASSET_NAME_LEN - 1);
+}
+
+int main(int argc, char **argv)
+{
+	struct pitft_pack_header hdr = { .version = PITFT_PACK_VERSION };
+	struct pitft_asset *index;
+	unsigned char **data;
+	struct image img;
+	size_t raw = 0, packed = 0;
+	uint32_t offset;
+	FILE *out;
+	int i, j, n;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s out.pak image.ppm [image.ppm ...]\n", argv[0]);
+		return 1;
+	}
+
+	n = argc - 2;
+	index = calloc(n, sizeof(*index));
+	data = calloc(n, sizeof(*data));
+	if (!index || !data)
+		return 1;
+
+	memcpy(hdr.magic, PITFT_PACK_MAGIC, 4);
+	hdr.count = n;
+	offset = sizeof(hdr) + n * sizeof(*index);
+
+	for (i = 0; i < n; i++) {
+		asset_name(argv[i + 2], index[i].name);
+		for (j = 0; j < i; j++) {
+			if (!strncmp(index[j].name, index[i].name, PITFT_ASSET_NAME_LEN)) {
+				fprintf(stderr, "%s: duplicate asset name '%s'\n", argv[i + 2],
+					index[i].name);
+				return 1;
+			}
+		}
+		if (ppm_read(argv[i + 2], &img))
+			return 1;
+		/* worst case is all literals */
+		data[i] = malloc(img.width * img.height * 2 +
+				 (img.width * img.height / PITFT_RLE_MAX + 1) * 2);
+		if (!data[i])
+			return 1;
+		index[i].width = img.width;
+		index[i].height = img.height;
+		index[i].offset = offset;
+		index[i].size = rle_encode(img.pixels, img.width * img.height, data[i]);
+		offset += index[i].size;
+		raw += img.width * img.height * 2;
+		packed += index[i].size;
+		printf("  %-24s %4dx%-4d %7d -> %7u bytes\n", index[i].name, img.width,
+		       img.height, img.width * img.height * 2, index[i].size);
+		free(img.pixels);
+	}
+
+	out = fopen(argv[1], "wb");
+	if (!out) {
+		perror(argv[1]);
+		return 1;
+	}
+	fwrite(&hdr, sizeof(hdr), 1, out);
+	fwrite(index, sizeof(*index), n, out);
+	for (i = 0; i < n; i++)
+		fwrite(data[i], 1, index[i].size, out);
+	if (fclose(out)) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	printf("%d assets, %zu bytes raw, %zu bytes packed\n", n, raw, packed);
+
+	return 0;
+}
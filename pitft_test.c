@@ -6,6 +6,8 @@
  * the Linux SPI driver and gpiolib.
  * http://www.airspayce.com/mikem/bcm2835/index.html
  *
+ * Build: gcc -Wall -o pitft_test pitft_test.c -lbcm2835 -lpthread -lrt
+ *
  * Copyright (C) 2014, Noralf Tronnes
  *
  * BSD License
@@ -13,26 +15,228 @@
  */
 
 #include <bcm2835.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pitft_asset.h"
 
 #define u8 uint8_t
 
 int verbose = 0;
 
+/* monotonic time in microseconds, for the benchmarks */
+uint64_t now_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Register cache
+ *
+ * Write-through shadow of the controller registers. A write with the same
+ * value as the cached one is skipped. Registers with side effects are not
+ * passed to the cache, and a reset invalidates it.
+ */
+
+#define REG_CACHE_MAX_LEN 16
+
+struct reg_cache {
+	const char *name;
+	u8 valid[256];
+	u8 len[256];
+	u8 val[256][REG_CACHE_MAX_LEN];
+	unsigned long writes;
+	unsigned long saved;
+	unsigned long saved_transactions;
+};
+
+int reg_cache_enabled = 1;
+struct reg_cache lcd_cache = { .name = "ILI9340" };
+struct reg_cache stmpe_cache = { .name = "STMPE811" };
+
+/*
+ * Returns 1 if the write can be skipped, otherwise the cache is updated.
+ * transactions is the number of bus transactions the write takes.
+ */
+int reg_cache_hit(struct reg_cache *cache, u8 reg, const u8 *val, int len, int transactions)
+{
+	cache->writes++;
+	if (!reg_cache_enabled || len > REG_CACHE_MAX_LEN)
+		return 0;
+
+	if (cache->valid[reg] && cache->len[reg] == len &&
+	    !memcmp(cache->val[reg], val, len)) {
+		cache->saved++;
+		cache->saved_transactions += transactions;
+		return 1;
+	}
+
+	memcpy(cache->val[reg], val, len);
+	cache->len[reg] = len;
+	cache->valid[reg] = 1;
+
+	return 0;
+}
+
+void reg_cache_invalidate(struct reg_cache *cache)
+{
+	memset(cache->valid, 0, sizeof(cache->valid));
+}
+
+void reg_cache_report(struct reg_cache *cache)
+{
+	if (!cache->writes)
+		return;
+
+	printf("  %s: %lu of %lu register writes skipped, %lu bus transactions saved\n",
+	       cache->name, cache->saved, cache->writes, cache->saved_transactions);
+}
+
+/*
+ * Latency statistics
+ */
+
+#define LAT_MAX_SAMPLES 4096
+
+struct lat_stats {
+	const char *name;
+	unsigned int n;
+	unsigned long dropped;
+	uint32_t us[LAT_MAX_SAMPLES];
+};
+
+void lat_reset(struct lat_stats *s)
+{
+	s->n = 0;
+	s->dropped = 0;
+}
+
+void lat_add(struct lat_stats *s, uint64_t us)
+{
+	if (s->n == LAT_MAX_SAMPLES) {
+		s->dropped++;
+		return;
+	}
+	s->us[s->n++] = us;
+}
+
+int lat_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* sorts the samples */
+void lat_report(struct lat_stats *s)
+{
+	unsigned int n = s->n;
+
+	if (!n) {
+		printf("  %-12s no samples\n", s->name);
+		return;
+	}
+
+	qsort(s->us, n, sizeof(s->us[0]), lat_cmp);
+	printf("  %-12s n=%-5u p50=%-7u p90=%-7u p99=%-7u max=%-7u us\n", s->name, n,
+	       s->us[(n - 1) * 50 / 100], s->us[(n - 1) * 90 / 100],
+	       s->us[(n - 1) * 99 / 100], s->us[n - 1]);
+	if (s->dropped)
+		printf("  %-12s %lu samples dropped\n", "", s->dropped);
+}
+
+/*
+ * SPI bus
+ *
+ * The display and the touch controller share the bus with different chip
+ * selects, modes and clocks. bus_select() switches the settings when the
+ * other device is addressed. With bus_chunk set, display data is sent in
+ * chunks of that size, and a pending touch interrupt is serviced between
+ * chunks so that large frame transfers don't hold off touch sampling.
+ */
+
+struct bus_dev {
+	const char *name;
+	int cs;
+	int mode;
+	int divider;
+};
+
+struct bus_dev lcd_dev = {
+	.name = "ILI9340",
+	.cs = BCM2835_SPI_CS0,
+	.mode = BCM2835_SPI_MODE0,
+	.divider = BCM2835_SPI_CLOCK_DIVIDER_16, /* 15.625MHz */
+};
+
+struct bus_dev touch_dev = {
+	.name = "STMPE811",
+	.cs = BCM2835_SPI_CS1,
+	.mode = BCM2835_SPI_MODE0,
+	.divider = BCM2835_SPI_CLOCK_DIVIDER_512, /* 488 kHz */
+};
+
+struct bus_dev *bus_cur;
+int bus_chunk;
+unsigned long bus_switches;
+
+void touch_service();
+
+void bus_select(struct bus_dev *dev)
+{
+	if (dev == bus_cur)
+		return;
+
+	if (!bus_cur || bus_cur->cs != dev->cs)
+		bcm2835_spi_chipSelect(dev->cs);
+	if (!bus_cur || bus_cur->mode != dev->mode)
+		bcm2835_spi_setDataMode(dev->mode);
+	if (!bus_cur || bus_cur->divider != dev->divider)
+		bcm2835_spi_setClockDivider(dev->divider);
+	bus_cur = dev;
+	bus_switches++;
+}
+
+/* the settings of a device changed, apply them on the next select */
+void bus_invalidate()
+{
+	bus_cur = NULL;
+}
+
 /*
  * LCD controller
  */
 
 #define DC_PIN 25
 
+#define LCD_WIDTH 240
+#define LCD_HEIGHT 320
+
+#define ILI9340_SWRESET 0x01
 #define ILI9340_SLPOUT 0x11
 #define ILI9340_GAMMASET 0x26
 #define ILI9340_DISPOFF 0x28
 #define ILI9340_DISPON 0x29
+#define ILI9340_CASET 0x2A
+#define ILI9340_PASET 0x2B
+#define ILI9340_RAMWR 0x2C
+#define ILI9340_RAMWRC 0x3C
 #define ILI9340_MADCTL 0x36
+#define ILI9340_MADCTL_MY 0x80
 #define ILI9340_MADCTL_MX 0x40
+#define ILI9340_MADCTL_MV 0x20
 #define ILI9340_MADCTL_BGR 0x08
 #define ILI9340_PIXFMT 0x3A
 #define ILI9340_FRMCTR1 0xB1
@@ -53,7 +257,135 @@ do {                                                                     \
 	write_register(NUMARGS(__VA_ARGS__), __VA_ARGS__); \
 } while (0)
 
-#define mdelay bcm2835_delay
+/* queued commands have to be sent before waiting */
+#define mdelay(ms)		\
+do {				\
+	lcd_flush();		\
+	bcm2835_delay(ms);	\
+} while (0)
+
+/*
+ * Command queue
+ *
+ * Command and data phases are queued instead of sent right away. Adjacent
+ * phases with the same DC level are merged into one transfer, and the DC
+ * line is only written when the level changes. The queue is sent when it
+ * is full and on lcd_flush(), which has to be called before the bus is
+ * used for something else or the result has to be on the display.
+ */
+
+#define CMDQ_SIZE 4096
+#define CMDQ_MAX_SEGS 64
+
+struct cmdq_seg {
+	int dc;
+	int len;
+};
+
+struct cmdq {
+	u8 buf[CMDQ_SIZE];
+	int len;
+	struct cmdq_seg seg[CMDQ_MAX_SEGS];
+	int nsegs;
+	int dc;		/* current DC pin level, -1 if unknown */
+	unsigned long phases;
+	unsigned long transfers;
+	unsigned long dc_writes;
+};
+
+struct cmdq cmdq = { .dc = -1 };
+int cmdq_enabled = 1;
+
+void lcd_flush()
+{
+	u8 *p = cmdq.buf;
+	int i, off, n;
+
+	for (i = 0; i < cmdq.nsegs; i++) {
+		if (cmdq.seg[i].dc != cmdq.dc) {
+			bcm2835_gpio_write(DC_PIN, cmdq.seg[i].dc ? HIGH : LOW);
+			cmdq.dc = cmdq.seg[i].dc;
+			cmdq.dc_writes++;
+		}
+		for (off = 0; off < cmdq.seg[i].len; off += n) {
+			n = cmdq.seg[i].len - off;
+			if (bus_chunk && n > bus_chunk)
+				n = bus_chunk;
+			bus_select(&lcd_dev);
+			bcm2835_spi_transfern(p + off, n);
+			cmdq.transfers++;
+			/* DC is only looked at while CS0 is asserted */
+			if (bus_chunk)
+				touch_service();
+		}
+		p += cmdq.seg[i].len;
+	}
+	cmdq.len = 0;
+	cmdq.nsegs = 0;
+}
+
+void lcd_queue(int dc, const u8 *data, int len)
+{
+	struct cmdq_seg *seg;
+	int n;
+
+	cmdq.phases++;
+	while (len) {
+		seg = cmdq.nsegs ? &cmdq.seg[cmdq.nsegs - 1] : NULL;
+		if (cmdq.len == CMDQ_SIZE || (cmdq.nsegs == CMDQ_MAX_SEGS && seg->dc != dc)) {
+			lcd_flush();
+			seg = NULL;
+		}
+		if (!seg || seg->dc != dc) {
+			seg = &cmdq.seg[cmdq.nsegs++];
+			seg->dc = dc;
+			seg->len = 0;
+		}
+		n = CMDQ_SIZE - cmdq.len;
+		if (n > len)
+			n = len;
+		memcpy(cmdq.buf + cmdq.len, data, n);
+		cmdq.len += n;
+		seg->len += n;
+		data += n;
+		len -= n;
+	}
+
+	if (!cmdq_enabled)
+		lcd_flush();
+}
+
+void cmdq_report()
+{
+	if (!cmdq.phases)
+		return;
+
+	printf("  %lu phases in %lu transfers (%.1f per transfer), %lu DC writes\n",
+	       cmdq.phases, cmdq.transfers,
+	       cmdq.transfers ? (double)cmdq.phases / cmdq.transfers : 0.0, cmdq.dc_writes);
+}
+
+/*
+ * Write pointer tracking
+ *
+ * After RAMWR the controller writes from the window start and wraps at
+ * the end column. If the next update starts where the last one ended,
+ * with the same columns, Memory Write Continue is sent instead of
+ * CASET/PASET/RAMWR. New windows are opened down to the last row so that
+ * vertically stacked updates like scanlines can continue.
+ */
+
+struct lcd_window {
+	int valid;
+	int xs, xe, ye;
+	int x, y;	/* write pointer */
+};
+
+struct lcd_window lcd_win;
+int win_reuse_enabled = 1;
+unsigned long win_updates;
+unsigned long win_reuse_hits;
+unsigned long lcd_commands;
 
 void write_register(int len, ...)
 {
@@ -61,133 +393,1571 @@ void write_register(int len, ...)
 	int i;
 	u8 buf[128];
 
+	va_start(args, len);
+	for (i = 0; i < len; i++)
+		buf[i] = (u8)va_arg(args, unsigned int);
+	va_end(args);
+
 	if (verbose) {
 		printf("%s: ", __func__);
-		va_start(args, len);
-		for (i = 0; i < len; i++) {
-			printf("%02X ", (u8)va_arg(args, unsigned int));
-		}
-		va_end(args);
+		for (i = 0; i < len; i++)
+			printf("%02X ", buf[i]);
+	}
+
+	if (buf[0] == ILI9340_SWRESET)
+		reg_cache_invalidate(&lcd_cache);
+	/* only the window commands are known not to move the write pointer */
+	if (buf[0] != ILI9340_CASET && buf[0] != ILI9340_PASET &&
+	    buf[0] != ILI9340_RAMWR && buf[0] != ILI9340_RAMWRC)
+		lcd_win.valid = 0;
+	/* RAMWR and commands without parameters always have an effect */
+	if (len > 1 && buf[0] != ILI9340_RAMWR &&
+	    reg_cache_hit(&lcd_cache, buf[0], buf + 1, len - 1, 2)) {
+		if (verbose)
+			printf("(cached)\n");
+		return;
+	}
+	if (verbose)
 		printf("\n");
+
+	lcd_commands++;
+	lcd_queue(0, buf, 1);
+	if (len > 1)
+		lcd_queue(1, buf + 1, len - 1);
+}
+
+/*
+ * Rotation
+ *
+ * The controller rotates in hardware through MADCTL, only the extents of
+ * the address window change. lcd_xres/lcd_yres are the logical extents.
+ */
+
+int lcd_rotate;
+int lcd_xres = LCD_WIDTH;
+int lcd_yres = LCD_HEIGHT;
+
+void lcd_set_rotation(int rotate)
+{
+	u8 madctl;
+
+	switch (rotate) {
+	case 90:
+		madctl = ILI9340_MADCTL_MV;
+		break;
+	case 180:
+		madctl = ILI9340_MADCTL_MY;
+		break;
+	case 270:
+		madctl = ILI9340_MADCTL_MX | ILI9340_MADCTL_MY | ILI9340_MADCTL_MV;
+		break;
+	default:
+		madctl = ILI9340_MADCTL_MX;
+		break;
 	}
+	write_reg(ILI9340_MADCTL, madctl | ILI9340_MADCTL_BGR);
 
-	va_start(args, len);
-	buf[0] = (u8)va_arg(args, unsigned int);
+	lcd_xres = (madctl & ILI9340_MADCTL_MV) ? LCD_HEIGHT : LCD_WIDTH;
+	lcd_yres = (madctl & ILI9340_MADCTL_MV) ? LCD_WIDTH : LCD_HEIGHT;
+}
+
+int init_display()
+{
+        write_reg(ILI9340_SWRESET); /* software reset */
+        mdelay(5);
+        write_reg(0x28); /* display off */
+
+	/* startup sequence taken from Adafruit, registers are undocumented */
+	write_reg(0xEF, 0x03, 0x80, 0x02);
+	write_reg(0xCF, 0x00, 0xC1, 0x30);
+	write_reg(0xED, 0x64, 0x03, 0x12, 0x81);
+	write_reg(0xE8, 0x85, 0x00, 0x78);
+	write_reg(0xCB, 0x39, 0x2C, 0x00, 0x34, 0x02);
+	write_reg(0xF7, 0x20);
+	write_reg(0xEA, 0x00, 0x00);
+
+	/* power control */
+	write_reg(ILI9340_PWCTR1, 0x23); //VRH[5:0]
+	write_reg(ILI9340_PWCTR2, 0x10); //SAP[2:0];BT[3:0]
+
+	/* VCM control */
+	write_reg(ILI9340_VMCTR1, 0x3e, 0x28);
+	write_reg(ILI9340_VMCTR2, 0x86);
+	lcd_set_rotation(lcd_rotate);
+	write_reg(ILI9340_PIXFMT, 0x55);
+        /* ------------frame rate----------------------------------- */
+	write_reg(ILI9340_FRMCTR1, 0x00, 0x18);
+ 
+	/* display function control */
+	write_reg(ILI9340_DFUNCTR, 0x08, 0x82, 0x27);
+ 
+	/* Gamma function disable */
+	write_reg(0xF2, 0x00);
+ 
+	/* gamma curve selected */
+	write_reg(ILI9340_GAMMASET, 0x01);
+ 
+	/* set gamma */
+	write_reg(ILI9340_GMCTRP1, 0x0F, 0x31, 0x2B, 0x0C, 0x0E, 0x08,
+			  0x4E, 0xF1, 0x37, 0x07, 0x10, 0x03, 0x0E,
+			  0x09, 0x00);
+  
+	/* set gamma */
+	write_reg(ILI9340_GMCTRN1, 0x00, 0x0E, 0x14, 0x03, 0x11, 0x07,
+			0x31, 0xC1, 0x48, 0x08, 0x0F, 0x0C, 0x31, 0x36, 0x0F);
+        /* ------------Gamma---------------------------------------- */
+        /* write_reg(0xF2, 0x08); */ /* Gamma Function Disable */
+        //write_reg(0x26, 0x01);
+
+	/* exit sleep */
+	write_reg(ILI9340_SLPOUT);
+
+	mdelay(100);
+
+	/* display on */
+	write_reg(ILI9340_DISPON);
+
+	mdelay(20);
+
+	return 0;
+}
+
+void set_addr_win(int xs, int ys, int xe, int ye)
+{
+	win_updates++;
+	if (win_reuse_enabled && lcd_win.valid && xs == lcd_win.xs && xe == lcd_win.xe &&
+	    xs == lcd_win.x && ys == lcd_win.y && ye <= lcd_win.ye) {
+		win_reuse_hits++;
+		write_reg(ILI9340_RAMWRC);
+		return;
+	}
+
+	if (win_reuse_enabled)
+		ye = lcd_yres - 1;
+	write_reg(ILI9340_CASET, (xs >> 8) & 0xFF, xs & 0xFF, (xe >> 8) & 0xFF, xe & 0xFF);
+	write_reg(ILI9340_PASET, (ys >> 8) & 0xFF, ys & 0xFF, (ye >> 8) & 0xFF, ye & 0xFF);
+	write_reg(ILI9340_RAMWR);
+
+	lcd_win.xs = xs;
+	lcd_win.xe = xe;
+	lcd_win.ye = ye;
+	lcd_win.x = xs;
+	lcd_win.y = ys;
+	lcd_win.valid = 1;
+}
+
+void lcd_write_pixels(const u8 *buf, int npixels)
+{
+	int w = lcd_win.xe - lcd_win.xs + 1;
+	int pos;
+
+	lcd_queue(1, buf, npixels * 2);
+
+	if (!lcd_win.valid)
+		return;
+	pos = lcd_win.y * w + (lcd_win.x - lcd_win.xs) + npixels;
+	lcd_win.x = lcd_win.xs + pos % w;
+	lcd_win.y = pos / w;
+	/* the pointer wrapped to the start of the window */
+	if (lcd_win.y > lcd_win.ye)
+		lcd_win.valid = 0;
+}
+
+void fill_display(unsigned int color)
+{
+	int i;
+	u8 buf[128];
+
+	set_addr_win(0, 0, lcd_xres - 1, lcd_yres - 1);
+	for (i = 0; i < lcd_xres * lcd_yres; i++) {
+		buf[0] = (color >> 8);
+		buf[1] = color & 0xFF;
+		lcd_write_pixels(buf, 1);
+	}
+}
+
+void display_setup()
+{
+	bus_select(&lcd_dev);
+	bcm2835_gpio_fsel(DC_PIN, BCM2835_GPIO_FSEL_OUTP);
+	cmdq.dc = -1;
+}
+
+void display_release()
+{
+	lcd_flush();
 	bcm2835_gpio_write(DC_PIN, LOW);
-	mdelay(10);
-	bcm2835_spi_transfern(buf, 1);
+	bcm2835_gpio_fsel(DC_PIN, BCM2835_GPIO_FSEL_INPT);
+}
+
+/* scanlines followed by 16x16 rectangles filled column by column */
+uint64_t win_bench_run()
+{
+	u8 line[LCD_HEIGHT * 2];	/* longest side */
+	u8 rect[16 * 16 * 2];
+	uint64_t start = now_us();
+	int x, y;
+
+	for (y = 0; y < lcd_yres; y++) {
+		set_addr_win(0, y, lcd_xres - 1, y);
+		memset(line, y, sizeof(line));
+		lcd_write_pixels(line, lcd_xres);
+	}
+
+	for (x = 0; x < lcd_xres; x += 16) {
+		for (y = 0; y < lcd_yres; y += 16) {
+			set_addr_win(x, y, x + 15, y + 15);
+			memset(rect, x ^ y, sizeof(rect));
+			lcd_write_pixels(rect, 16 * 16);
+		}
+	}
+	lcd_flush();
+
+	return now_us() - start;
+}
+
+void win_bench()
+{
+	unsigned long commands;
+	uint64_t us;
+	int reuse;
+
+	printf("\nWindow reuse benchmark\n");
+
+	display_setup();
+	init_display();
+
+	for (reuse = 0; reuse < 2; reuse++) {
+		win_reuse_enabled = reuse;
+		lcd_win.valid = 0;
+		win_updates = 0;
+		win_reuse_hits = 0;
+		commands = lcd_commands;
+		us = win_bench_run();
+		printf("  %-8s %6llu us, %lu updates, %lu continued, %lu commands\n",
+		       reuse ? "reuse:" : "no reuse:", (unsigned long long)us,
+		       win_updates, win_reuse_hits, lcd_commands - commands);
+	}
+
+	display_release();
+}
+
+/*
+ * Software rotation
+ *
+ * Used for single rectangles when MADCTL can't be changed in the middle of
+ * a frame. The rectangle is rotated into panel orientation (rotation 0)
+ * and the destination window is computed from the logical position.
+ * A plain 90/270 degree transpose walks one of the buffers column wise,
+ * missing the cache on every pixel, so it is done in small square tiles
+ * that fit in L1. 180 degrees is a reverse copy and needs no tiling.
+ */
+
+#define ROT_TILE 16
+
+/* rotate the w x h rectangle src clockwise into dst, tiled or per pixel */
+void rotate_rect(uint16_t *dst, const uint16_t *src, int w, int h, int rotate, int tile)
+{
+	int i, j, ti, tj, ie, je;
+
+	if (rotate == 180) {
+		for (i = 0; i < w * h; i++)
+			dst[w * h - 1 - i] = src[i];
+		return;
+	}
+	if (rotate != 90 && rotate != 270) {
+		memcpy(dst, src, w * h * 2);
+		return;
+	}
+	if (!tile)
+		tile = w > h ? w : h;
+
+	for (tj = 0; tj < h; tj += tile) {
+		je = tj + tile < h ? tj + tile : h;
+		for (ti = 0; ti < w; ti += tile) {
+			ie = ti + tile < w ? ti + tile : w;
+			for (j = tj; j < je; j++) {
+				for (i = ti; i < ie; i++) {
+					if (rotate == 90)
+						dst[i * h + (h - 1 - j)] = src[j * w + i];
+					else
+						dst[(w - 1 - i) * h + j] = src[j * w + i];
+				}
+			}
+		}
+	}
+}
+
+uint16_t rot_buf[LCD_WIDTH * LCD_HEIGHT];
+
+/*
+ * Write the logical w x h rectangle at x,y on a panel in rotation 0,
+ * transposing in tile x tile blocks (0 is per pixel, see rotate_rect()).
+ * Returns the time spent rotating in microseconds.
+ */
+uint64_t lcd_write_rect_rotated(int x, int y, int w, int h, const uint16_t *src,
+				int rotate, int tile)
+{
+	uint64_t start = now_us();
+	int xs, ys, pw, ph;
+
+	rotate_rect(rot_buf, src, w, h, rotate, tile);
+
+	switch (rotate) {
+	case 90:
+		xs = LCD_WIDTH - y - h;
+		ys = x;
+		break;
+	case 180:
+		xs = LCD_WIDTH - x - w;
+		ys = LCD_HEIGHT - y - h;
+		break;
+	case 270:
+		xs = y;
+		ys = LCD_HEIGHT - x - w;
+		break;
+	default:
+		xs = x;
+		ys = y;
+		break;
+	}
+	pw = (rotate == 90 || rotate == 270) ? h : w;
+	ph = (rotate == 90 || rotate == 270) ? w : h;
+	start = now_us() - start;
+
+	set_addr_win(xs, ys, xs + pw - 1, ys + ph - 1);
+	lcd_write_pixels((u8 *)rot_buf, w * h);
+
+	return start;
+}
+
+#define ROT_BENCH_LOOPS 10
+
+uint16_t rot_src[LCD_WIDTH * LCD_HEIGHT];
+
+/* a full frame in 90 degrees: MADCTL, per pixel transpose, tiled transpose */
+void rot_bench()
+{
+	int w = LCD_HEIGHT, h = LCD_WIDTH;
+	uint64_t start, us, rot_us;
+	int i, tile;
+
+	printf("\nRotation benchmark, %dx%d frame rotated 90 degrees\n", w, h);
+
+	for (i = 0; i < w * h; i++)
+		rot_src[i] = i;
+
+	display_setup();
+	init_display();
+
+	lcd_set_rotation(90);
+	start = now_us();
+	set_addr_win(0, 0, w - 1, h - 1);
+	lcd_write_pixels((u8 *)rot_src, w * h);
+	lcd_flush();
+	printf("  %-16s %6llu us\n", "MADCTL:", (unsigned long long)(now_us() - start));
+
+	lcd_set_rotation(0);
+	for (tile = 0; tile <= ROT_TILE; tile += ROT_TILE) {
+		start = now_us();
+		for (i = 0; i < ROT_BENCH_LOOPS; i++)
+			rotate_rect(rot_buf, rot_src, w, h, 90, tile);
+		rot_us = (now_us() - start) / ROT_BENCH_LOOPS;
+
+		start = now_us();
+		lcd_write_rect_rotated(0, 0, w, h, rot_src, 90, tile);
+		lcd_flush();
+		us = now_us() - start;
+
+		printf("  %-16s %6llu us, transpose %llu us\n",
+		       tile ? "tiled transpose:" : "transpose:",
+		       (unsigned long long)us, (unsigned long long)rot_us);
+	}
+
+	lcd_set_rotation(lcd_rotate);
+	display_release();
+}
+
+/*
+ * Tearing effect synchronization
+ *
+ * With TEON the controller pulses its TE output at the start of vertical
+ * blanking. A frame is started on the rising edge and written in bands of
+ * rows. Before each band the scanline position is estimated from the time
+ * since the last edge, and the band is held back if the scanline would
+ * cross it while it's written. A frame that is written faster than the
+ * panel refreshes stays ahead of the scanline, one taking more than a
+ * refresh period ends up trailing it instead of crossing it.
+ * The scan runs along panel rows, so this is done in rotation 0.
+ * Without TE wired up, a simulated source gives edges at the refresh rate
+ * set by FRMCTR1 in init_display().
+ */
+
+#define ILI9340_TEOFF 0x34
+#define ILI9340_TEON 0x35
+
+#define TE_SIM_PERIOD_US 12658	/* 79 Hz */
+#define TE_FRAMES 100
+#define TE_BAND 32
+#define TE_TIMEOUT_US 1000000
+
+int te_pin = -1;	/* simulated when negative */
+uint64_t te_edge_us;	/* last edge */
+uint64_t te_period_us = TE_SIM_PERIOD_US;
+uint64_t te_band_us;	/* estimated time to write a band */
+unsigned long te_missed;
+unsigned long te_held;
+unsigned long te_collisions;
+struct lat_stats te_slack = { .name = "slack" };
+
+/* returns the time of the next rising edge, 0 on timeout */
+uint64_t te_wait_edge()
+{
+	uint64_t now = now_us();
+	uint64_t timeout = now + TE_TIMEOUT_US;
+
+	if (te_pin < 0) {
+		now += te_period_us - (now - te_edge_us) % te_period_us;
+		while (now_us() < now)
+			;
+		return now;
+	}
+
+	while (bcm2835_gpio_lev(te_pin))
+		if (now_us() > timeout)
+			return 0;
+	while (!bcm2835_gpio_lev(te_pin))
+		if (now_us() > timeout)
+			return 0;
+	return now_us();
+}
+
+/* returns the number of refresh periods since the previous edge, -1 on timeout */
+int te_wait()
+{
+	uint64_t edge = te_wait_edge();
+	int n;
+
+	if (!edge)
+		return -1;
+	n = (edge - te_edge_us + te_period_us / 2) / te_period_us;
+	te_edge_us = edge;
+	return n;
+}
+
+int te_setup()
+{
+	uint64_t edge;
+
+	write_reg(ILI9340_TEON, 0x00);	/* V-blank only */
+
+	te_edge_us = now_us();
+	if (te_pin < 0)
+		return 0;
+
+	/* measure the refresh period */
+	bcm2835_gpio_fsel(te_pin, BCM2835_GPIO_FSEL_INPT);
+	te_edge_us = te_wait_edge();
+	edge = te_edge_us ? te_wait_edge() : 0;
+	if (!edge) {
+		fprintf(stderr, "no TE edges on GPIO%d\n", te_pin);
+		return -1;
+	}
+	te_period_us = edge - te_edge_us;
+	te_edge_us = edge;
+
+	return 0;
+}
+
+int te_scan_row(uint64_t now)
+{
+	return (now - te_edge_us) % te_period_us * LCD_HEIGHT / te_period_us;
+}
+
+/*
+ * The band can be written without the scanline crossing it: either the
+ * scanline hasn't reached the band and won't get past its end before the
+ * band is done, or it has passed the band and won't be back during the
+ * write.
+ */
+int te_band_clear(int y0, int y1)
+{
+	int row = te_scan_row(now_us());
+	int scan_rows = te_band_us * LCD_HEIGHT / te_period_us;
+
+	if (row <= y0)
+		return row + scan_rows <= y1;
+
+	return row >= y1 && row + scan_rows - LCD_HEIGHT < y0;
+}
+
+void te_write_band(int frame, int y0, int y1, int sync)
+{
+	u8 line[LCD_WIDTH * 2];
+	uint64_t start, timeout;
+	int x, y;
+
+	/*
+	 * A band that takes most of a refresh period is never clear, hold it
+	 * back for at most a period and then count it as crossed
+	 */
+	if (!te_band_clear(y0, y1)) {
+		if (sync) {
+			te_held++;
+			timeout = now_us() + te_period_us;
+			while (!te_band_clear(y0, y1)) {
+				if (now_us() > timeout) {
+					te_collisions++;
+					break;
+				}
+			}
+		} else {
+			te_collisions++;
+		}
+	}
+
+	start = now_us();
+	set_addr_win(0, y0, LCD_WIDTH - 1, y1 - 1);
+	for (y = y0; y < y1; y++) {
+		for (x = 0; x < LCD_WIDTH; x++) {
+			line[x * 2] = x + frame * 8;
+			line[x * 2 + 1] = y + frame * 4;
+		}
+		lcd_write_pixels(line, LCD_WIDTH);
+	}
+	lcd_flush();
+	te_band_us = (te_band_us * 3 + now_us() - start) / 4;
+}
+
+void te_bench()
+{
+	uint64_t start, us, end;
+	int sync, frame, y, n;
+
+	printf("\nTearing effect sync benchmark, %s TE", te_pin < 0 ? "simulated" : "GPIO");
+	if (te_pin >= 0)
+		printf(" on GPIO%d", te_pin);
+	printf("\n");
+
+	display_setup();
+	init_display();
+	lcd_set_rotation(0);
+	if (te_setup())
+		goto out;
+	printf("  Refresh period %llu us\n", (unsigned long long)te_period_us);
+
+	for (sync = 0; sync < 2; sync++) {
+		te_missed = 0;
+		te_held = 0;
+		te_collisions = 0;
+		lat_reset(&te_slack);
+
+		start = now_us();
+		for (frame = 0; frame < TE_FRAMES; frame++) {
+			if (sync) {
+				n = te_wait();
+				if (n < 0) {
+					fprintf(stderr, "no TE edges on GPIO%d\n", te_pin);
+					goto out;
+				}
+				if (frame && n > 1)
+					te_missed += n - 1;
+			}
+			for (y = 0; y < LCD_HEIGHT; y += TE_BAND)
+				te_write_band(frame, y, y + TE_BAND, sync);
+			if (sync) {
+				end = now_us();
+				lat_add(&te_slack, te_period_us - (end - te_edge_us) % te_period_us);
+			}
+		}
+		us = now_us() - start;
+
+		printf("  %-8s %llu us/frame, %lu bands crossed by the scanline, %lu held back, %lu missed vsync\n",
+		       sync ? "sync:" : "no sync:", (unsigned long long)(us / TE_FRAMES),
+		       te_collisions, te_held, te_missed);
+		if (sync)
+			lat_report(&te_slack);
+	}
+
+out:
+	write_reg(ILI9340_TEOFF);
+	lcd_set_rotation(lcd_rotate);
+	display_release();
+}
+
+/*
+ * Frame preparation
+ *
+ * An XRGB8888 frame is converted to RGB565 with ordered dithering and
+ * compared with the previous frame in 16x16 tiles, spread over a small
+ * thread pool. Each thread starts on its own run of tiles and steals from
+ * the end of the other runs when it's done; the calling thread is worker 0.
+ * Results are stored per tile, so the transfer list, built afterwards in
+ * column order, doesn't depend on which thread did the work. Tiles stacked
+ * in a column are sent with Memory Write Continue.
+ * Rotation is left to MADCTL (-r).
+ */
+
+#define PREP_TILE 16
+#define PREP_TILES_X (LCD_WIDTH / PREP_TILE)
+#define PREP_TILES_Y (LCD_HEIGHT / PREP_TILE)
+#define PREP_TILES (PREP_TILES_X * PREP_TILES_Y)
+#define PREP_MAX_THREADS 4
+#define PREP_FRAMES 50
+
+struct prep_tile {
+	int dirty;
+	u8 pixels[PREP_TILE * PREP_TILE * 2];
+};
+
+struct prep_queue {
+	pthread_mutex_t lock;
+	int head, tail;
+};
+
+struct prep_pool {
+	pthread_t threads[PREP_MAX_THREADS];
+	struct prep_queue queues[PREP_MAX_THREADS];
+	int nthreads;
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	unsigned int generation;
+	int busy;
+	int quit;
+	unsigned long steals;
+};
+
+struct prep_pool prep_pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.start = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+uint32_t prep_src[LCD_WIDTH * LCD_HEIGHT];
+uint16_t prep_prev[LCD_WIDTH * LCD_HEIGHT];
+struct prep_tile prep_tiles[PREP_TILES];
+int prep_list[PREP_TILES];
+int prep_nlist;
+
+const u8 prep_bayer[4][4] = {
+	{  0,  8,  2, 10 },
+	{ 12,  4, 14,  6 },
+	{  3, 11,  1,  9 },
+	{ 15,  7, 13,  5 },
+};
+
+void prep_tile_run(int t)
+{
+	struct prep_tile *tile = &prep_tiles[t];
+	int x0 = (t % PREP_TILES_X) * PREP_TILE;
+	int y0 = (t / PREP_TILES_X) * PREP_TILE;
+	u8 *out = tile->pixels;
+	int x, y, d, r, g, b;
+	uint32_t p;
+	uint16_t c;
+
+	tile->dirty = 0;
+	for (y = y0; y < y0 + PREP_TILE; y++) {
+		for (x = x0; x < x0 + PREP_TILE; x++) {
+			p = prep_src[y * LCD_WIDTH + x];
+			d = prep_bayer[y & 3][x & 3];
+			r = ((p >> 16) & 0xFF) + (d >> 1);
+			g = ((p >> 8) & 0xFF) + (d >> 2);
+			b = (p & 0xFF) + (d >> 1);
+			c = ((r > 0xFF ? 0xFF : r) & 0xF8) << 8 |
+			    ((g > 0xFF ? 0xFF : g) & 0xFC) << 3 |
+			    (b > 0xFF ? 0xFF : b) >> 3;
+			if (c != prep_prev[y * LCD_WIDTH + x]) {
+				prep_prev[y * LCD_WIDTH + x] = c;
+				tile->dirty = 1;
+			}
+			*out++ = c >> 8;
+			*out++ = c & 0xFF;
+		}
+	}
+}
+
+/* the next tile from our own run, or the last one of someone else's */
+int prep_take(int self)
+{
+	struct prep_queue *q = &prep_pool.queues[self];
+	int i, t = -1;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->head < q->tail)
+		t = q->head++;
+	pthread_mutex_unlock(&q->lock);
+	if (t >= 0)
+		return t;
+
+	for (i = 1; i < prep_pool.nthreads && t < 0; i++) {
+		q = &prep_pool.queues[(self + i) % prep_pool.nthreads];
+		pthread_mutex_lock(&q->lock);
+		if (q->head < q->tail)
+			t = --q->tail;
+		pthread_mutex_unlock(&q->lock);
+	}
+	if (t >= 0)
+		__sync_fetch_and_add(&prep_pool.steals, 1);
+
+	return t;
+}
+
+void *prep_worker(void *arg)
+{
+	int self = (long)arg;
+	unsigned int generation = 0;
+	int t;
+
+	for (;;) {
+		pthread_mutex_lock(&prep_pool.lock);
+		while (prep_pool.generation == generation && !prep_pool.quit)
+			pthread_cond_wait(&prep_pool.start, &prep_pool.lock);
+		generation = prep_pool.generation;
+		if (prep_pool.quit) {
+			pthread_mutex_unlock(&prep_pool.lock);
+			return NULL;
+		}
+		pthread_mutex_unlock(&prep_pool.lock);
+
+		while ((t = prep_take(self)) >= 0)
+			prep_tile_run(t);
+
+		pthread_mutex_lock(&prep_pool.lock);
+		if (--prep_pool.busy == 0)
+			pthread_cond_signal(&prep_pool.done);
+		pthread_mutex_unlock(&prep_pool.lock);
+	}
+}
+
+/* on failure prep_pool_stop() joins the threads that were started */
+int prep_pool_start(int nthreads)
+{
+	int i, j;
+
+	if (nthreads > PREP_MAX_THREADS)
+		nthreads = PREP_MAX_THREADS;
+	prep_pool.nthreads = nthreads;
+	prep_pool.generation = 0;
+	prep_pool.quit = 0;
+	prep_pool.steals = 0;
+	for (i = 0; i < nthreads; i++)
+		pthread_mutex_init(&prep_pool.queues[i].lock, NULL);
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&prep_pool.threads[i], NULL, prep_worker, (void *)(long)i)) {
+			perror("pthread_create");
+			for (j = i; j < nthreads; j++)
+				pthread_mutex_destroy(&prep_pool.queues[j].lock);
+			prep_pool.nthreads = i;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void prep_pool_stop()
+{
+	int i;
+
+	pthread_mutex_lock(&prep_pool.lock);
+	prep_pool.quit = 1;
+	pthread_cond_broadcast(&prep_pool.start);
+	pthread_mutex_unlock(&prep_pool.lock);
+	for (i = 1; i < prep_pool.nthreads; i++)
+		pthread_join(prep_pool.threads[i], NULL);
+	for (i = 0; i < prep_pool.nthreads; i++)
+		pthread_mutex_destroy(&prep_pool.queues[i].lock);
+}
+
+/* convert prep_src and build the list of changed tiles */
+void prep_frame()
+{
+	int n = prep_pool.nthreads;
+	int i, t, tx, ty;
+
+	for (i = 0; i < n; i++) {
+		prep_pool.queues[i].head = PREP_TILES * i / n;
+		prep_pool.queues[i].tail = PREP_TILES * (i + 1) / n;
+	}
+
+	pthread_mutex_lock(&prep_pool.lock);
+	prep_pool.busy = n - 1;
+	prep_pool.generation++;
+	pthread_cond_broadcast(&prep_pool.start);
+	pthread_mutex_unlock(&prep_pool.lock);
+
+	while ((t = prep_take(0)) >= 0)
+		prep_tile_run(t);
+
+	pthread_mutex_lock(&prep_pool.lock);
+	while (prep_pool.busy)
+		pthread_cond_wait(&prep_pool.done, &prep_pool.lock);
+	pthread_mutex_unlock(&prep_pool.lock);
+
+	prep_nlist = 0;
+	for (tx = 0; tx < PREP_TILES_X; tx++) {
+		for (ty = 0; ty < PREP_TILES_Y; ty++) {
+			t = ty * PREP_TILES_X + tx;
+			if (prep_tiles[t].dirty)
+				prep_list[prep_nlist++] = t;
+		}
+	}
+}
+
+void prep_send()
+{
+	int i, x, y;
+
+	for (i = 0; i < prep_nlist; i++) {
+		x = (prep_list[i] % PREP_TILES_X) * PREP_TILE;
+		y = (prep_list[i] / PREP_TILES_X) * PREP_TILE;
+		set_addr_win(x, y, x + PREP_TILE - 1, y + PREP_TILE - 1);
+		lcd_write_pixels(prep_tiles[prep_list[i]].pixels, PREP_TILE * PREP_TILE);
+	}
+	lcd_flush();
+}
+
+/* a gradient with a box moving across it */
+void prep_render(int frame)
+{
+	int bx = (frame * 4) % (LCD_WIDTH - 40);
+	int by = (frame * 6) % (LCD_HEIGHT - 40);
+	int x, y;
+
+	for (y = 0; y < LCD_HEIGHT; y++) {
+		for (x = 0; x < LCD_WIDTH; x++) {
+			if (x >= bx && x < bx + 40 && y >= by && y < by + 40)
+				prep_src[y * LCD_WIDTH + x] = 0xFFFFFF;
+			else
+				prep_src[y * LCD_WIDTH + x] = (x * 255 / LCD_WIDTH) << 16 |
+							      (y * 255 / LCD_HEIGHT) << 8 | 0x40;
+		}
+	}
+}
+
+void prep_bench()
+{
+	int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	uint64_t start, us;
+	unsigned long dirty;
+	int n, frame;
+
+	printf("\nFrame preparation benchmark, %d cores\n", ncpu);
+
+	for (n = 1; n <= PREP_MAX_THREADS; n *= 2) {
+		if (prep_pool_start(n)) {
+			prep_pool_stop();
+			break;
+		}
+		memset(prep_prev, 0, sizeof(prep_prev));
+		dirty = 0;
+		us = 0;
+		for (frame = 0; frame < PREP_FRAMES; frame++) {
+			prep_render(frame);
+			start = now_us();
+			prep_frame();
+			us += now_us() - start;
+			dirty += prep_nlist;
+		}
+		printf("  %d thread%s %6llu us/frame, %lu dirty tiles/frame, %lu steals\n",
+		       n, n > 1 ? "s:" : ": ", (unsigned long long)(us / PREP_FRAMES),
+		       dirty / PREP_FRAMES, prep_pool.steals);
+		prep_pool_stop();
+	}
+
+	/* show it on the panel with the pool sized to the core count */
+	display_setup();
+	init_display();
+	lcd_set_rotation(0);
+	if (prep_pool_start(ncpu > 0 ? ncpu : 1)) {
+		prep_pool_stop();
+		goto out;
+	}
+	memset(prep_prev, 0, sizeof(prep_prev));
+	start = now_us();
+	for (frame = 0; frame < PREP_FRAMES; frame++) {
+		prep_render(frame);
+		prep_frame();
+		prep_send();
+	}
+	printf("  Sent %d frames, %llu us/frame\n", PREP_FRAMES,
+	       (unsigned long long)((now_us() - start) / PREP_FRAMES));
+	prep_pool_stop();
+out:
+	lcd_set_rotation(lcd_rotate);
+	display_release();
+}
+
+/*
+ * Indexed color
+ *
+ * Frames are kept as 8-bit indices into a 256 entry palette, which halves
+ * the memory for the frame and for the copy kept for diffing. The palette
+ * is applied one line at a time, right before the line is queued for SPI.
+ * Changing the palette redraws the screen without touching the frame.
+ */
+
+#define IDX_FRAMES 50
+
+u8 idx_fb[LCD_HEIGHT][LCD_WIDTH];
+u8 idx_prev[LCD_HEIGHT][LCD_WIDTH];
+u8 idx_lut[256][2];	/* RGB565 big endian */
+int idx_lut_changed;
+
+void idx_set_palette(int first, int n, const uint16_t *colors)
+{
+	int i;
+
+	for (i = 0; i < n && first + i < 256; i++) {
+		idx_lut[first + i][0] = colors[i] >> 8;
+		idx_lut[first + i][1] = colors[i] & 0xFF;
+	}
+	idx_lut_changed = 1;
+}
+
+void idx_write_rows(int y0, int y1)
+{
+	u8 line[LCD_WIDTH * 2];
+	const u8 *c;
+	int x, y;
+
+	set_addr_win(0, y0, LCD_WIDTH - 1, y1 - 1);
+	for (y = y0; y < y1; y++) {
+		for (x = 0; x < LCD_WIDTH; x++) {
+			c = idx_lut[idx_fb[y][x]];
+			line[x * 2] = c[0];
+			line[x * 2 + 1] = c[1];
+		}
+		lcd_write_pixels(line, LCD_WIDTH);
+	}
+}
+
+/* send the runs of changed lines, returns the number of lines sent */
+int idx_update()
+{
+	int y, y0, lines = 0;
+
+	for (y = 0; y < LCD_HEIGHT; y++) {
+		if (!idx_lut_changed && !memcmp(idx_fb[y], idx_prev[y], LCD_WIDTH))
+			continue;
+		y0 = y;
+		while (y < LCD_HEIGHT &&
+		       (idx_lut_changed || memcmp(idx_fb[y], idx_prev[y], LCD_WIDTH))) {
+			memcpy(idx_prev[y], idx_fb[y], LCD_WIDTH);
+			y++;
+		}
+		idx_write_rows(y0, y);
+		lines += y - y0;
+	}
+	idx_lut_changed = 0;
+	lcd_flush();
+
+	return lines;
+}
+
+/* a vertical gradient with a band moving down */
+void idx_render(int frame, u8 *fb, int bpp)
+{
+	int band = frame * 6 % (LCD_HEIGHT - 24);
+	int x, y, c;
+
+	for (y = 0; y < LCD_HEIGHT; y++) {
+		c = (y >= band && y < band + 24) ? 255 : y * 200 / LCD_HEIGHT;
+		for (x = 0; x < LCD_WIDTH; x++, fb += bpp) {
+			fb[0] = bpp == 1 ? c : c >> 3 << 3;
+			if (bpp == 2)
+				fb[1] = c >> 2 << 5;
+		}
+	}
+}
+
+uint16_t idx_gray(int i)
+{
+	return (i >> 3) << 11 | (i >> 2) << 5 | (i >> 3);
+}
+
+void idx_bench()
+{
+	static u8 rgb_fb[LCD_HEIGHT][LCD_WIDTH * 2];
+	static u8 rgb_prev[LCD_HEIGHT][LCD_WIDTH * 2];
+	uint16_t palette[256];
+	uint64_t start, diff_us, us;
+	unsigned long lines;
+	int frame, y, y0, i;
+
+	printf("\nIndexed color benchmark\n");
+
+	display_setup();
+	init_display();
+	lcd_set_rotation(0);
+
+	/* RGB565 frame with line diffing */
+	memset(rgb_prev, 0, sizeof(rgb_prev));
+	diff_us = us = lines = 0;
+	for (frame = 0; frame < IDX_FRAMES; frame++) {
+		idx_render(frame, rgb_fb[0], 2);
+		start = now_us();
+		for (y = 0; y < LCD_HEIGHT; y++)
+			if (memcmp(rgb_fb[y], rgb_prev[y], LCD_WIDTH * 2))
+				lines++;
+		diff_us += now_us() - start;
+		for (y = 0; y < LCD_HEIGHT; y++) {
+			if (!memcmp(rgb_fb[y], rgb_prev[y], LCD_WIDTH * 2))
+				continue;
+			for (y0 = y; y < LCD_HEIGHT && memcmp(rgb_fb[y], rgb_prev[y], LCD_WIDTH * 2); y++)
+				memcpy(rgb_prev[y], rgb_fb[y], LCD_WIDTH * 2);
+			set_addr_win(0, y0, LCD_WIDTH - 1, y - 1);
+			lcd_write_pixels(rgb_fb[y0], LCD_WIDTH * (y - y0));
+		}
+		lcd_flush();
+		us += now_us() - start;
+	}
+	printf("  %-9s %6u bytes, diff %4llu us, %6llu us/frame, %lu lines/frame\n", "RGB565:",
+	       (unsigned int)(sizeof(rgb_fb) + sizeof(rgb_prev)),
+	       (unsigned long long)(diff_us / IDX_FRAMES), (unsigned long long)(us / IDX_FRAMES),
+	       lines / IDX_FRAMES);
+
+	/* the same frames indexed */
+	for (i = 0; i < 256; i++)
+		palette[i] = idx_gray(i);
+	idx_set_palette(0, 256, palette);
+	memset(idx_prev, 0, sizeof(idx_prev));
+	diff_us = us = lines = 0;
+	for (frame = 0; frame < IDX_FRAMES; frame++) {
+		idx_render(frame, idx_fb[0], 1);
+		start = now_us();
+		for (y = 0; y < LCD_HEIGHT; y++)
+			if (memcmp(idx_fb[y], idx_prev[y], LCD_WIDTH))
+				lines++;
+		diff_us += now_us() - start;
+		idx_update();
+		us += now_us() - start;
+	}
+	printf("  %-9s %6u bytes, diff %4llu us, %6llu us/frame, %lu lines/frame\n", "indexed:",
+	       (unsigned int)(sizeof(idx_fb) + sizeof(idx_prev) + sizeof(idx_lut)),
+	       (unsigned long long)(diff_us / IDX_FRAMES), (unsigned long long)(us / IDX_FRAMES),
+	       lines / IDX_FRAMES);
+
+	/* rotate the palette, the frame stays the same */
+	start = now_us();
+	for (frame = 0; frame < IDX_FRAMES; frame++) {
+		for (i = 0; i < 256; i++)
+			palette[i] = idx_gray((i + frame * 8) & 0xFF);
+		idx_set_palette(0, 256, palette);
+		idx_update();
+	}
+	printf("  %-9s %6llu us/frame\n", "palette:",
+	       (unsigned long long)((now_us() - start) / IDX_FRAMES));
+
+	lcd_set_rotation(lcd_rotate);
+	display_release();
+}
+
+/*
+ * Asset packs
+ *
+ * Packs made by pitft_pack are mapped, not read. Runs are expanded from a
+ * line buffer filled with the run colour, which is only refilled when the
+ * colour changes, and literal pixels are queued straight from the mapping.
+ */
+
+#define RLE_LINE 256	/* pixels */
+#define ASSET_LOOPS 10
+
+struct asset_pack {
+	const u8 *data;
+	size_t size;
+};
+
+int asset_pack_open(const char *path, struct asset_pack *pack)
+{
+	struct stat st;
+	void *p;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+	if (fstat(fd, &st)) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		perror(path);
+		return -1;
+	}
+	pack->data = p;
+	pack->size = st.st_size;
+
+	return 0;
+}
+
+void asset_pack_close(struct asset_pack *pack)
+{
+	munmap((void *)pack->data, pack->size);
+}
+
+/* returns the number of pixels drawn, never more than fits the window */
+int rle_draw(const struct asset_pack *pack, const struct pitft_asset *a, int x, int y)
+{
+	static u8 line[RLE_LINE * 2];
+	static int line_color = -1;
+	const u8 *p = pack->data + a->offset;
+	const u8 *end = p + a->size;
+	int n, color, pixels = 0;
+	int max = a->width * a->height;
+	uint16_t count;
+
+	set_addr_win(x, y, x + a->width - 1, y + a->height - 1);
+	while (p + 2 <= end && pixels < max) {
+		memcpy(&count, p, 2);
+		p += 2;
+		if (count & PITFT_RLE_RUN) {
+			count &= PITFT_RLE_MAX;
+			if (p + 2 > end)
+				break;
+			if (count > max - pixels)
+				count = max - pixels;
+			color = p[0] << 8 | p[1];
+			p += 2;
+			if (color != line_color) {
+				for (n = 0; n < RLE_LINE; n++) {
+					line[n * 2] = color >> 8;
+					line[n * 2 + 1] = color & 0xFF;
+				}
+				line_color = color;
+			}
+			pixels += count;
+			while (count) {
+				n = count < RLE_LINE ? count : RLE_LINE;
+				lcd_write_pixels(line, n);
+				count -= n;
+			}
+		} else {
+			if (p + count * 2 > end)
+				break;
+			if (count > max - pixels)
+				count = max - pixels;
+			lcd_write_pixels(p, count);
+			p += count * 2;
+			pixels += count;
+		}
+	}
+
+	return pixels;
+}
+
+/*
+ * to big endian RGB565 in memory, stops at max pixels
+ * returns the number of pixels, -1 if the data holds more than max
+ */
+int rle_expand(const struct asset_pack *pack, const struct pitft_asset *a, u8 *dst, int max)
+{
+	const u8 *p = pack->data + a->offset;
+	const u8 *end = p + a->size;
+	u8 *start = dst;
+	int n = 0;
+	uint16_t count;
+
+	while (p + 2 <= end) {
+		memcpy(&count, p, 2);
+		p += 2;
+		if (count & PITFT_RLE_RUN) {
+			count &= PITFT_RLE_MAX;
+			if (p + 2 > end)
+				break;
+			if (count > max - n)
+				return -1;
+			n += count;
+			while (count--) {
+				*dst++ = p[0];
+				*dst++ = p[1];
+			}
+			p += 2;
+		} else {
+			if (p + count * 2 > end)
+				break;
+			if (count > max - n)
+				return -1;
+			n += count;
+			memcpy(dst, p, count * 2);
+			dst += count * 2;
+			p += count * 2;
+		}
+	}
+
+	return (dst - start) / 2;
+}
+
+void asset_bench(const char *path)
+{
+	const struct pitft_pack_header *hdr;
+	const struct pitft_asset *a;
+	struct asset_pack pack;
+	uint64_t start, load_us, expand_us, raw_us, rle_us;
+	size_t raw_size = 0;
+	unsigned int i;
+	u8 *raw;
+	int j, n;
+
+	printf("\nAsset pack benchmark, %s\n", path);
+
+	start = now_us();
+	if (asset_pack_open(path, &pack))
+		return;
+	hdr = (const void *)pack.data;
+	a = pitft_pack_index(pack.data, pack.size);
+	if (!a) {
+		fprintf(stderr, "%s: broken pack\n", path);
+		asset_pack_close(&pack);
+		return;
+	}
+	load_us = now_us() - start;
+	for (i = 0; i < hdr->count; i++)
+		raw_size += a[i].width * a[i].height * 2;
+	printf("  %u assets, %zu bytes packed, %zu bytes raw, loaded in %llu us\n",
+	       hdr->count, pack.size, raw_size, (unsigned long long)load_us);
+
+	display_setup();
+	init_display();
+	lcd_set_rotation(0);
+
+	for (i = 0; i < hdr->count; i++, a++) {
+		if (a->width > LCD_WIDTH || a->height > LCD_HEIGHT) {
+			printf("  %-24s larger than the panel, skipped\n", a->name);
+			continue;
+		}
+		raw = malloc(a->width * a->height * 2);
+		if (!raw)
+			break;
+
+		n = rle_expand(&pack, a, raw, a->width * a->height);
+		if (n != a->width * a->height) {
+			printf("  %-24s broken image data, skipped\n", a->name);
+			free(raw);
+			continue;
+		}
+
+		start = now_us();
+		for (j = 0; j < ASSET_LOOPS; j++)
+			rle_expand(&pack, a, raw, n);
+		expand_us = (now_us() - start) / ASSET_LOOPS;
+
+		start = now_us();
+		for (j = 0; j < ASSET_LOOPS; j++) {
+			set_addr_win(0, 0, a->width - 1, a->height - 1);
+			lcd_write_pixels(raw, n);
+			lcd_flush();
+		}
+		raw_us = (now_us() - start) / ASSET_LOOPS;
+
+		start = now_us();
+		for (j = 0; j < ASSET_LOOPS; j++) {
+			rle_draw(&pack, a, 0, 0);
+			lcd_flush();
+		}
+		rle_us = (now_us() - start) / ASSET_LOOPS;
+
+		printf("  %-24s %3dx%-3d %6u bytes (%d%%), expand %4llu us (%.0f MB/s), blit raw %6llu us, rle %6llu us\n",
+		       a->name, a->width, a->height, a->size,
+		       a->size * 100 / (a->width * a->height * 2), (unsigned long long)expand_us,
+		       expand_us ? (double)n * 2 / expand_us : 0.0,
+		       (unsigned long long)raw_us, (unsigned long long)rle_us);
+		free(raw);
+	}
+
+	lcd_set_rotation(lcd_rotate);
+	display_release();
+	asset_pack_close(&pack);
+}
+
+/*
+ * Panel server
+ *
+ * The server owns SPI and the panel, and shares a frame buffer with the
+ * clients through POSIX shared memory. Clients draw straight into the
+ * frame buffer and then post the damaged rectangle on a ring. Any number
+ * of clients can post at the same time without locks or syscalls: a
+ * client claims a slot by advancing the tail with compare-and-swap, fills
+ * it in and publishes it through the slot sequence number. The server is
+ * the only consumer. It marks the damage on the 16x16 tile grid used for
+ * frame preparation, and sends the dirty tiles column by column.
+ * When the ring is full the client sets the overflow flag, and the server
+ * sends the whole frame on its next pass.
+ */
+
+#define SHM_NAME "/pitft"
+#define SHM_MAGIC 0x50544654
+#define SHM_RING_SIZE 256	/* power of two */
+#define SHM_IDLE_US 1000
+#define CLIENT_FRAMES 500
+#define CLIENT_BOX 32
+
+struct shm_damage {
+	uint32_t seq;
+	int16_t x, y, w, h;
+};
+
+struct shm_panel {
+	uint32_t magic;
+	uint32_t width, height;
+	uint32_t tail;		/* next slot to claim, shared by the clients */
+	uint32_t head;		/* next slot to consume, server only */
+	uint32_t overflow;
+	struct shm_damage ring[SHM_RING_SIZE];
+	u8 fb[LCD_HEIGHT][LCD_WIDTH * 2];	/* RGB565 big endian */
+};
+
+struct shm_panel *shm;
+volatile sig_atomic_t shm_quit;
+
+void shm_sigint(int sig)
+{
+	shm_quit = 1;
+}
+
+struct shm_panel *shm_map(int create)
+{
+	struct shm_panel *p;
+	int fd, i;
+
+	fd = shm_open(SHM_NAME, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0666);
+	if (fd < 0) {
+		perror("shm_open");
+		return NULL;
+	}
+	if (create && ftruncate(fd, sizeof(*p))) {
+		perror("ftruncate");
+		close(fd);
+		return NULL;
+	}
+	p = mmap(NULL, sizeof(*p), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+
+	if (create) {
+		p->width = LCD_WIDTH;
+		p->height = LCD_HEIGHT;
+		for (i = 0; i < SHM_RING_SIZE; i++)
+			p->ring[i].seq = i;
+		__atomic_store_n(&p->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+	} else if (__atomic_load_n(&p->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC) {
+		fprintf(stderr, "%s: server not running\n", SHM_NAME);
+		munmap(p, sizeof(*p));
+		return NULL;
+	}
+
+	return p;
+}
+
+/* returns 0 when posted, -1 if the ring is full */
+int shm_damage_post(struct shm_panel *p, int x, int y, int w, int h)
+{
+	uint32_t pos = __atomic_load_n(&p->tail, __ATOMIC_RELAXED);
+	struct shm_damage *slot;
+	uint32_t seq;
 
-	len--;
-	if (len) {
-		bcm2835_gpio_write(DC_PIN, HIGH);
-		i = len;
-		for (i = 0; i < len; i++) {
-			buf[i] = (u8)va_arg(args, unsigned int);
+	for (;;) {
+		slot = &p->ring[pos & (SHM_RING_SIZE - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&p->tail, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((int32_t)(seq - pos) < 0) {
+			__atomic_store_n(&p->overflow, 1, __ATOMIC_RELEASE);
+			return -1;
+		} else {
+			pos = __atomic_load_n(&p->tail, __ATOMIC_RELAXED);
 		}
-		bcm2835_spi_transfern(buf, len);
 	}
-	va_end(args);
+
+	slot->x = x;
+	slot->y = y;
+	slot->w = w;
+	slot->h = h;
+	/* publishes the rectangle and the pixels drawn before it */
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	return 0;
 }
 
-int init_display()
+int shm_damage_take(struct shm_panel *p, struct shm_damage *d)
 {
-        write_reg(0x01); /* software reset */
-        mdelay(5);
-        write_reg(0x28); /* display off */
+	uint32_t pos = p->head;
+	struct shm_damage *slot = &p->ring[pos & (SHM_RING_SIZE - 1)];
 
-	/* startup sequence taken from Adafruit, registers are undocumented */
-	write_reg(0xEF, 0x03, 0x80, 0x02);
-	write_reg(0xCF, 0x00, 0xC1, 0x30);
-	write_reg(0xED, 0x64, 0x03, 0x12, 0x81);
-	write_reg(0xE8, 0x85, 0x00, 0x78);
-	write_reg(0xCB, 0x39, 0x2C, 0x00, 0x34, 0x02);
-	write_reg(0xF7, 0x20);
-	write_reg(0xEA, 0x00, 0x00);
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+		return 0;
 
-	/* power control */
-	write_reg(ILI9340_PWCTR1, 0x23); //VRH[5:0]
-	write_reg(ILI9340_PWCTR2, 0x10); //SAP[2:0];BT[3:0]
+	*d = *slot;
+	__atomic_store_n(&slot->seq, pos + SHM_RING_SIZE, __ATOMIC_RELEASE);
+	p->head = pos + 1;
 
-	/* VCM control */
-	write_reg(ILI9340_VMCTR1, 0x3e, 0x28);
-	write_reg(ILI9340_VMCTR2, 0x86);
-	write_reg(ILI9340_MADCTL, ILI9340_MADCTL_MX | ILI9340_MADCTL_BGR);
-	write_reg(ILI9340_PIXFMT, 0x55);
-        /* ------------frame rate----------------------------------- */
-	write_reg(ILI9340_FRMCTR1, 0x00, 0x18);
- 
-	/* display function control */
-	write_reg(ILI9340_DFUNCTR, 0x08, 0x82, 0x27);
- 
-	/* Gamma function disable */
-	write_reg(0xF2, 0x00);
- 
-	/* gamma curve selected */
-	write_reg(ILI9340_GAMMASET, 0x01);
- 
-	/* set gamma */
-	write_reg(ILI9340_GMCTRP1, 0x0F, 0x31, 0x2B, 0x0C, 0x0E, 0x08,
-			  0x4E, 0xF1, 0x37, 0x07, 0x10, 0x03, 0x0E,
-			  0x09, 0x00);
-  
-	/* set gamma */
-	write_reg(ILI9340_GMCTRN1, 0x00, 0x0E, 0x14, 0x03, 0x11, 0x07,
-			0x31, 0xC1, 0x48, 0x08, 0x0F, 0x0C, 0x31, 0x36, 0x0F);
-        /* ------------Gamma---------------------------------------- */
-        /* write_reg(0xF2, 0x08); */ /* Gamma Function Disable */
-        //write_reg(0x26, 0x01);
+	return 1;
+}
 
-	/* exit sleep */
-	write_reg(ILI9340_SLPOUT);
+void shm_mark(u8 *dirty, int x, int y, int w, int h)
+{
+	int tx, ty;
 
-	mdelay(100);
+	if (x < 0) {
+		w += x;
+		x = 0;
+	}
+	if (y < 0) {
+		h += y;
+		y = 0;
+	}
+	if (x + w > LCD_WIDTH)
+		w = LCD_WIDTH - x;
+	if (y + h > LCD_HEIGHT)
+		h = LCD_HEIGHT - y;
+	if (w <= 0 || h <= 0)
+		return;
 
-	/* display on */
-	write_reg(ILI9340_DISPON);
+	for (ty = y / PREP_TILE; ty <= (y + h - 1) / PREP_TILE; ty++)
+		for (tx = x / PREP_TILE; tx <= (x + w - 1) / PREP_TILE; tx++)
+			dirty[ty * PREP_TILES_X + tx] = 1;
+}
 
-	mdelay(20);
+/* one window per run of dirty tiles in a column */
+int shm_send(u8 *dirty)
+{
+	int tx, ty, y0, y, x, windows = 0;
 
-	return 0;
+	for (tx = 0; tx < PREP_TILES_X; tx++) {
+		x = tx * PREP_TILE;
+		for (ty = 0; ty < PREP_TILES_Y; ty++) {
+			if (!dirty[ty * PREP_TILES_X + tx])
+				continue;
+			y0 = ty;
+			while (ty < PREP_TILES_Y && dirty[ty * PREP_TILES_X + tx])
+				dirty[ty++ * PREP_TILES_X + tx] = 0;
+			set_addr_win(x, y0 * PREP_TILE, x + PREP_TILE - 1, ty * PREP_TILE - 1);
+			for (y = y0 * PREP_TILE; y < ty * PREP_TILE; y++)
+				lcd_write_pixels(shm->fb[y] + x * 2, PREP_TILE);
+			windows++;
+		}
+	}
+	lcd_flush();
+
+	return windows;
 }
 
-void set_addr_win(int xs, int ys, int xe, int ye)
+void shm_server()
 {
-	write_reg(0x2A, (xs >> 8) & 0xFF, xs & 0xFF, (xe >> 8) & 0xFF, xe & 0xFF);
-	write_reg(0x2B, (ys >> 8) & 0xFF, ys & 0xFF, (ye >> 8) & 0xFF, ye & 0xFF);
-	write_reg(0x2C);
+	unsigned long rects = 0, passes = 0, windows = 0, overflows = 0;
+	u8 dirty[PREP_TILES];
+	struct shm_damage d;
+	int n;
+
+	shm = shm_map(1);
+	if (!shm)
+		return;
+
+	printf("\nPanel server on %s, stop with Ctrl-C\n", SHM_NAME);
+	signal(SIGINT, shm_sigint);
+	signal(SIGTERM, shm_sigint);
+
+	display_setup();
+	init_display();
+	lcd_set_rotation(0);
+	memset(dirty, 1, sizeof(dirty));
+
+	while (!shm_quit) {
+		n = 0;
+		while (shm_damage_take(shm, &d)) {
+			shm_mark(dirty, d.x, d.y, d.w, d.h);
+			n++;
+		}
+		if (__atomic_exchange_n(&shm->overflow, 0, __ATOMIC_ACQUIRE)) {
+			memset(dirty, 1, sizeof(dirty));
+			overflows++;
+			n++;
+		}
+		if (!n && passes) {
+			usleep(SHM_IDLE_US);
+			continue;
+		}
+		rects += n;
+		windows += shm_send(dirty);
+		passes++;
+	}
+
+	printf("  %lu damage rectangles in %lu passes, %lu windows, %lu overflows\n",
+	       rects, passes, windows, overflows);
+
+	lcd_set_rotation(lcd_rotate);
+	display_release();
+	__atomic_store_n(&shm->magic, 0, __ATOMIC_RELEASE);
+	munmap(shm, sizeof(*shm));
+	shm_unlink(SHM_NAME);
 }
 
-void fill_display(unsigned int color)
+/* a box bouncing across the screen, in a colour per client id */
+int shm_client(int id)
 {
-	int i;
-	u8 buf[128];
+	unsigned long posted = 0, dropped = 0;
+	uint16_t color = 0x1F << (id % 3 * 5 + (id % 3 == 2));
+	int x = id * 37 % (LCD_WIDTH - CLIENT_BOX), y = 0, dy = 4;
+	int frame, i, j, oy;
 
-	set_addr_win(0, 0, 239, 319);
-	bcm2835_gpio_write(DC_PIN, HIGH);
-	for (i = 0; i < 320*240; i++) {
-		buf[0] = (color >> 8);
-		buf[1] = color & 0xFF;
-		bcm2835_spi_transfern(buf, 2);
+	shm = shm_map(0);
+	if (!shm)
+		return 1;
+
+	signal(SIGINT, shm_sigint);
+	printf("Client %d drawing\n", id);
+
+	for (frame = 0; frame < CLIENT_FRAMES && !shm_quit; frame++) {
+		oy = y;
+		if (y + dy < 0 || y + dy > LCD_HEIGHT - CLIENT_BOX)
+			dy = -dy;
+		y += dy;
+		for (j = 0; j < CLIENT_BOX; j++)
+			memset(shm->fb[oy + j] + x * 2, 0, CLIENT_BOX * 2);
+		for (j = 0; j < CLIENT_BOX; j++) {
+			for (i = 0; i < CLIENT_BOX; i++) {
+				shm->fb[y + j][(x + i) * 2] = color >> 8;
+				shm->fb[y + j][(x + i) * 2 + 1] = color & 0xFF;
+			}
+		}
+		if (shm_damage_post(shm, x, oy < y ? oy : y, CLIENT_BOX, CLIENT_BOX + abs(dy)))
+			dropped++;
+		else
+			posted++;
+		usleep(20000);
 	}
+
+	printf("Client %d: %lu damage rectangles posted, %lu on a full ring\n", id, posted, dropped);
+	munmap(shm, sizeof(*shm));
+
+	return 0;
 }
 
 void display_test()
 {
 	printf("\nTest writing to display controller\n");
 
-	bcm2835_spi_setDataMode(BCM2835_SPI_MODE0);
-	bcm2835_spi_setClockDivider(BCM2835_SPI_CLOCK_DIVIDER_16); /* 15.625MHz */
-	bcm2835_spi_chipSelect(BCM2835_SPI_CS0);
-
-	bcm2835_gpio_fsel(DC_PIN, BCM2835_GPIO_FSEL_OUTP);
+	display_setup();
 
 	printf("  Initialize controller\n");
 	init_display();
 	printf("  Fill display with red color\n");
 	fill_display(0b1111100000000000); /* RGB565 red */
 
-	bcm2835_gpio_write(DC_PIN, LOW);
-	bcm2835_gpio_fsel(DC_PIN, BCM2835_GPIO_FSEL_INPT);
+	display_release();
 }
 
 /*
@@ -212,10 +1982,11 @@ void display_test()
 #define STMPE811_REG_CHIP_ID            0x00
 #define STMPE811_REG_SYS_CTRL1          0x03
 #define STMPE811_REG_SYS_CTRL2          0x04
+#define STMPE811_SYS_CTRL1_SOFT_RESET   (1 << 1)
 #define STMPE811_REG_SPI_CFG            0x08
-//#define STMPE811_REG_INT_CTRL           0x09
-//#define STMPE811_REG_INT_EN             0x0A
-//#define STMPE811_REG_INT_STA            0x0B
+#define STMPE811_REG_INT_CTRL           0x09
+#define STMPE811_REG_INT_EN             0x0A
+#define STMPE811_REG_INT_STA            0x0B
 //#define STMPE811_REG_GPIO_INT_EN        0x0C
 //#define STMPE811_REG_GPIO_INT_STA       0x0D
 #define STMPE811_REG_GPIO_SET_PIN       0x10
@@ -226,6 +1997,17 @@ void display_test()
 //#define STMPE811_REG_GPIO_RE            0x15
 //#define STMPE811_REG_GPIO_FE            0x16
 #define STMPE811_REG_GPIO_AF            0x17
+#define STMPE811_REG_ADC_CTRL1          0x20
+#define STMPE811_REG_ADC_CTRL2          0x21
+#define STMPE811_REG_TSC_CTRL           0x40
+#define STMPE811_REG_TSC_CFG            0x41
+#define STMPE811_REG_FIFO_TH            0x4A
+#define STMPE811_REG_FIFO_STA           0x4B
+#define STMPE811_REG_FIFO_SIZE          0x4C
+#define STMPE811_REG_TSC_DATA           0xD7
+
+#define STMPE811_INT_FIFO_TH            (1 << 1)
+#define STMPE811_FIFO_STA_RESET         (1 << 0)
 
 #define GPIO_2 (1 << 2)
 
@@ -234,6 +2016,7 @@ unsigned int stmpe_chip_id()
 	u8 buf[1];
 	unsigned int id;
 
+	bus_select(&touch_dev);
 	buf[0] = READ_CMD | STMPE811_REG_CHIP_ID;
 	bcm2835_spi_transfern(buf, 1);
 	buf[0] = READ_CMD | (STMPE811_REG_CHIP_ID + 1);
@@ -252,6 +2035,7 @@ u8 stmpe_read_reg(u8 reg)
 
 	if (verbose)
 		printf("%s(reg=0x%02X) -> ", __func__, reg);
+	bus_select(&touch_dev);
 	buf[0] = READ_CMD | reg;
 	bcm2835_spi_transfern(buf, 1);
 	buf[0] = 0x00;
@@ -262,39 +2046,130 @@ u8 stmpe_read_reg(u8 reg)
 	return buf[0];
 }
 
+/* registers where a write is an action */
+int stmpe_reg_volatile(u8 reg)
+{
+	switch (reg) {
+	case STMPE811_REG_SYS_CTRL1:
+	case STMPE811_REG_INT_STA:
+	case STMPE811_REG_GPIO_SET_PIN:
+	case STMPE811_REG_GPIO_CLR_PIN:
+	case STMPE811_REG_FIFO_STA:
+		return 1;
+	}
+
+	return 0;
+}
+
 void stmpe_write_reg(u8 reg, u8 val)
 {
-	u8 buf[1];
+	u8 buf[2];
+
+	if (reg == STMPE811_REG_SYS_CTRL1 && (val & STMPE811_SYS_CTRL1_SOFT_RESET))
+		reg_cache_invalidate(&stmpe_cache);
+	if (!stmpe_reg_volatile(reg) && reg_cache_hit(&stmpe_cache, reg, &val, 1, 1)) {
+		if (verbose)
+			printf("%s(reg=0x%02X, val=0x%02X) (cached)\n", __func__, reg, val);
+		return;
+	}
 
 	if (verbose)
 		printf("%s(reg=0x%02X, val=0x%02X)\n", __func__, reg, val);
+	bus_select(&touch_dev);
 	buf[0] = reg;
 	buf[1] = val;
 	bcm2835_spi_transfern(buf, 2);
 }
 
-
-void touch_test()
+/* try SPI mode 0 and then mode 3, returns the chip id */
+unsigned int stmpe_detect()
 {
 	unsigned int id;
-	int i;
-
-	printf("\nTest communication with touch controller STMPE610\n");
-
-	bcm2835_spi_setDataMode(BCM2835_SPI_MODE0);
-	bcm2835_spi_setClockDivider(BCM2835_SPI_CLOCK_DIVIDER_512); /* 488 kHz */
-	bcm2835_spi_chipSelect(BCM2835_SPI_CS1);
 
+	touch_dev.mode = BCM2835_SPI_MODE0;
+	bus_invalidate();
 	id = stmpe_chip_id();
 	if (id != 0x0811) {
 		/* I don't understand why mode 0 doesn't work */
 		if (verbose)
 			printf("trying SPI mode 3\n");
-		bcm2835_spi_setDataMode(BCM2835_SPI_MODE3);
+		touch_dev.mode = BCM2835_SPI_MODE3;
+		bus_invalidate();
 		id = stmpe_chip_id();
 	}
 
-	id = stmpe_chip_id();
+	return stmpe_chip_id();
+}
+
+/* the SET/CLR registers only affect the pins in the mask */
+void stmpe_set_pins(u8 mask)
+{
+	stmpe_write_reg(STMPE811_REG_GPIO_SET_PIN, mask);
+}
+
+void stmpe_clr_pins(u8 mask)
+{
+	stmpe_write_reg(STMPE811_REG_GPIO_CLR_PIN, mask);
+}
+
+#define GPIO_BENCH_LOOPS 1000
+
+/*
+ * Toggle the pins in mask, one pin per register write and then all of
+ * them in one write, and print the pins toggled per second.
+ */
+void gpio_bench(u8 mask)
+{
+	uint64_t start, single_us, bulk_us;
+	unsigned int pins = 0;
+	int i, pin;
+
+	printf("\nGPIO expander benchmark, mask 0x%02X\n", mask);
+
+	if (stmpe_detect() != 0x0811) {
+		printf("\n\nTEST FAILED\nUnexpected chip id, should be 0x0811\n\n");
+		return;
+	}
+
+	for (pin = 0; pin < 8; pin++)
+		if (mask & (1 << pin))
+			pins++;
+	if (!pins)
+		return;
+
+	stmpe_write_reg(STMPE811_REG_GPIO_AF, mask);
+	stmpe_write_reg(STMPE811_REG_GPIO_DIR, mask);
+
+	start = now_us();
+	for (i = 0; i < GPIO_BENCH_LOOPS; i++) {
+		for (pin = 0; pin < 8; pin++)
+			if (mask & (1 << pin))
+				stmpe_clr_pins(1 << pin);
+		for (pin = 0; pin < 8; pin++)
+			if (mask & (1 << pin))
+				stmpe_set_pins(1 << pin);
+	}
+	single_us = now_us() - start;
+
+	start = now_us();
+	for (i = 0; i < GPIO_BENCH_LOOPS; i++) {
+		stmpe_clr_pins(mask);
+		stmpe_set_pins(mask);
+	}
+	bulk_us = now_us() - start;
+
+	printf("  single: %llu pins/s\n", 2ULL * GPIO_BENCH_LOOPS * pins * 1000000 / (single_us ? single_us : 1));
+	printf("  bulk:   %llu pins/s\n", 2ULL * GPIO_BENCH_LOOPS * pins * 1000000 / (bulk_us ? bulk_us : 1));
+}
+
+void touch_test()
+{
+	unsigned int id;
+	int i;
+
+	printf("\nTest communication with touch controller STMPE610\n");
+
+	id = stmpe_detect();
 	printf("  Chip id: 0x%04x\n", id);
 
 	if (id != 0x0811) {
@@ -310,7 +2185,7 @@ void touch_test()
 	}
 
 	/* reset controller */
-	stmpe_write_reg(STMPE811_REG_SYS_CTRL1, 0b00000010);
+	stmpe_write_reg(STMPE811_REG_SYS_CTRL1, STMPE811_SYS_CTRL1_SOFT_RESET);
 
 	/* Turn on GPIO and TSC clocks */
 	stmpe_write_reg(STMPE811_REG_SYS_CTRL2, 0b00000001);
@@ -332,25 +2207,484 @@ void touch_test()
 	}
 }
 
+/*
+ * Touch sampling
+ *
+ * The controller is set up for XYZ samples with an interrupt for every
+ * sample. touch_service() is called between display chunks and reads the
+ * FIFO when the IRQ line is asserted. The line is only sampled there, so
+ * the latency recorded is the time since it was last seen idle, an upper
+ * bound of the real latency.
+ */
+
+#define TOUCH_MAX_BATCH 16
+
+struct touch_point {
+	int x, y, z;
+};
+
+int touch_sched_enabled;
+uint64_t touch_idle_us;
+unsigned long touch_samples;
+struct lat_stats touch_lat = { .name = "irq->read" };
+
+void touch_setup()
+{
+	stmpe_write_reg(STMPE811_REG_SYS_CTRL1, STMPE811_SYS_CTRL1_SOFT_RESET);
+	mdelay(10);
+	/* ADC, TSC and GPIO clocks on, temperature sensor off */
+	stmpe_write_reg(STMPE811_REG_SYS_CTRL2, 0x08);
+	/* 80 clocks conversion, 12-bit, 3.25 MHz */
+	stmpe_write_reg(STMPE811_REG_ADC_CTRL1, 0x48);
+	stmpe_write_reg(STMPE811_REG_ADC_CTRL2, 0x01);
+	/* average 4 samples, 500 us touch detect delay, 500 us settling */
+	stmpe_write_reg(STMPE811_REG_TSC_CFG, 0x9A);
+	stmpe_write_reg(STMPE811_REG_FIFO_TH, 1);
+	stmpe_write_reg(STMPE811_REG_FIFO_STA, STMPE811_FIFO_STA_RESET);
+	stmpe_write_reg(STMPE811_REG_FIFO_STA, 0);
+	/* XYZ mode, enabled */
+	stmpe_write_reg(STMPE811_REG_TSC_CTRL, 0x01);
+	stmpe_write_reg(STMPE811_REG_INT_STA, 0xFF);
+	stmpe_write_reg(STMPE811_REG_INT_EN, STMPE811_INT_FIFO_TH);
+	/* level interrupt, active low, global enable */
+	stmpe_write_reg(STMPE811_REG_INT_CTRL, 0x01);
+
+	bcm2835_gpio_fsel(IRQ_PIN, BCM2835_GPIO_FSEL_INPT);
+}
+
+/* 12-bit x and y and 8-bit z packed in 4 bytes */
+void touch_decode(const u8 *d, struct touch_point *pt)
+{
+	pt->x = (d[0] << 4) | (d[1] >> 4);
+	pt->y = ((d[1] & 0xF) << 8) | d[2];
+	pt->z = d[3];
+}
+
+void touch_encode(const struct touch_point *pt, u8 *d)
+{
+	d[0] = pt->x >> 4;
+	d[1] = ((pt->x & 0xF) << 4) | ((pt->y >> 8) & 0xF);
+	d[2] = pt->y & 0xFF;
+	d[3] = pt->z;
+}
+
+/* the data for each address byte comes back in the next byte */
+int touch_read_fifo(struct touch_point *pts, int max)
+{
+	u8 buf[4 * TOUCH_MAX_BATCH + 1];
+	u8 *d;
+	int i, n;
+
+	n = stmpe_read_reg(STMPE811_REG_FIFO_SIZE);
+	if (n > max)
+		n = max;
+	if (n) {
+		memset(buf, READ_CMD | STMPE811_REG_TSC_DATA, 4 * n);
+		buf[4 * n] = 0x00;
+		bus_select(&touch_dev);
+		bcm2835_spi_transfern(buf, 4 * n + 1);
+		for (i = 0, d = buf + 1; i < n; i++, d += 4)
+			touch_decode(d, &pts[i]);
+	}
+	stmpe_write_reg(STMPE811_REG_INT_STA, 0xFF);
+
+	return n;
+}
+
+void touch_service()
+{
+	struct touch_point pts[TOUCH_MAX_BATCH];
+	uint64_t now;
+
+	if (!touch_sched_enabled)
+		return;
+
+	now = now_us();
+	if (bcm2835_gpio_lev(IRQ_PIN)) {
+		touch_idle_us = now;
+		return;
+	}
+
+	lat_add(&touch_lat, now - touch_idle_us);
+	touch_samples += touch_read_fifo(pts, TOUCH_MAX_BATCH);
+	touch_idle_us = now_us();
+}
+
+void draw_frame(int frame)
+{
+	u8 line[LCD_HEIGHT * 2];	/* longest side */
+	int x, y;
+
+	set_addr_win(0, 0, lcd_xres - 1, lcd_yres - 1);
+	for (y = 0; y < lcd_yres; y++) {
+		for (x = 0; x < lcd_xres; x++) {
+			line[x * 2] = x + y + frame * 8;
+			line[x * 2 + 1] = y - frame * 4;
+		}
+		lcd_write_pixels(line, lcd_xres);
+	}
+}
+
+#define TOUCH_SCHED_FRAMES 50
+#define TOUCH_SCHED_CHUNK 1024
+
+/*
+ * Run a full screen animation while sampling touch, first servicing the
+ * touch controller only between frames and then between chunks.
+ */
+void touch_sched_bench()
+{
+	uint64_t start, us;
+	unsigned long switches;
+	int pass, frame;
+
+	printf("\nTouch priority benchmark, keep touching the screen during the animation\n");
+
+	if (stmpe_detect() != 0x0811) {
+		printf("\n\nTEST FAILED\nUnexpected chip id, should be 0x0811\n\n");
+		return;
+	}
+	touch_setup();
+
+	display_setup();
+	init_display();
+
+	for (pass = 0; pass < 2; pass++) {
+		bus_chunk = pass ? TOUCH_SCHED_CHUNK : 0;
+		lat_reset(&touch_lat);
+		touch_samples = 0;
+		switches = bus_switches;
+		touch_idle_us = now_us();
+		touch_sched_enabled = 1;
+
+		start = now_us();
+		for (frame = 0; frame < TOUCH_SCHED_FRAMES; frame++) {
+			draw_frame(frame);
+			lcd_flush();
+			touch_service();
+		}
+		us = now_us() - start;
+		touch_sched_enabled = 0;
+
+		if (pass)
+			printf("  chunks of %d bytes:\n", bus_chunk);
+		else
+			printf("  between frames:\n");
+		printf("  %.1f fps, %lu touch samples, %lu bus switches\n",
+		       TOUCH_SCHED_FRAMES * 1000000.0 / us, touch_samples, bus_switches - switches);
+		lat_report(&touch_lat);
+	}
+	bus_chunk = 0;
+
+	display_release();
+}
+
+/*
+ * Touch to photon latency
+ *
+ * A marker is drawn at every touch point and each stage is timestamped:
+ * IRQ seen, FIFO read, pixels queued and the last byte sent. The input is
+ * either the touch controller, a recording made with -o, or a simulated
+ * diamond shaped stroke. For recorded and simulated input the samples are encoded as
+ * FIFO data and go through the same decoding as live samples, the IRQ is
+ * the time the sample is due.
+ * The recording format is one sample per line: <delay_us> <x> <y> <z>
+ */
+
+#define T2P_SAMPLES 200
+#define T2P_SIM_PERIOD_US 10000
+#define T2P_MARKER 5
+
+struct lat_stats t2p_read = { .name = "irq->read" };
+struct lat_stats t2p_queue = { .name = "read->queued" };
+struct lat_stats t2p_wire = { .name = "queued->wire" };
+struct lat_stats t2p_total = { .name = "total" };
+
+void draw_marker(const struct touch_point *pt)
+{
+	u8 buf[T2P_MARKER * T2P_MARKER * 2];
+	int x = pt->x * (lcd_xres - T2P_MARKER) / 4096;
+	int y = pt->y * (lcd_yres - T2P_MARKER) / 4096;
+
+	memset(buf, 0xFF, sizeof(buf));
+	set_addr_win(x, y, x + T2P_MARKER - 1, y + T2P_MARKER - 1);
+	lcd_write_pixels(buf, T2P_MARKER * T2P_MARKER);
+}
+
+/* returns the number of samples, 0 when the input is exhausted */
+int t2p_next(FILE *in, int n, struct touch_point *pts, uint64_t *irq_us)
+{
+	struct touch_point pt;
+	unsigned long delay;
+	u8 raw[4];
+	uint64_t due;
+
+	if (!in) {
+		/* simulated: a diamond, one sample every T2P_SIM_PERIOD_US */
+		pt.x = 2048 + 1500 * ((n % 64) < 32 ? (n % 32) - 16 : 16 - (n % 32)) / 16;
+		pt.y = 2048 + 1500 * (((n + 16) % 64) < 32 ? ((n + 16) % 32) - 16 : 16 - ((n + 16) % 32)) / 16;
+		pt.z = 128;
+		delay = T2P_SIM_PERIOD_US;
+	} else if (fscanf(in, "%lu %d %d %d", &delay, &pt.x, &pt.y, &pt.z) != 4) {
+		return 0;
+	}
+	pt.x &= 0xFFF;
+	pt.y &= 0xFFF;
+	pt.z &= 0xFF;
+
+	due = *irq_us + delay;
+	while (now_us() < due)
+		;
+	*irq_us = now_us();
+
+	touch_encode(&pt, raw);
+	touch_decode(raw, &pts[0]);
+
+	return 1;
+}
+
+/* returns the number of samples, 0 on timeout */
+int t2p_next_live(struct touch_point *pts, uint64_t *irq_us)
+{
+	uint64_t timeout = now_us() + 10000000;
+	int n;
+
+	/* an interrupt with an empty FIFO (e.g. touch up) doesn't end the wait */
+	do {
+		while (bcm2835_gpio_lev(IRQ_PIN))
+			if (now_us() > timeout)
+				return 0;
+		*irq_us = now_us();
+		n = touch_read_fifo(pts, TOUCH_MAX_BATCH);
+	} while (!n && now_us() <= timeout);
+
+	return n;
+}
+
+/* source is "live", "sim" or a recording */
+void t2p_bench(const char *source, const char *record)
+{
+	struct touch_point pts[TOUCH_MAX_BATCH];
+	uint64_t t_irq, t_read, t_queued, t_wire, last = 0;
+	int live = !strcmp(source, "live");
+	FILE *in = NULL, *out = NULL;
+	int i, n;
+
+	printf("\nTouch to photon latency, input: %s\n", source);
+
+	if (!live && strcmp(source, "sim")) {
+		in = fopen(source, "r");
+		if (!in) {
+			perror(source);
+			return;
+		}
+	}
+	if (record && live) {
+		out = fopen(record, "w");
+		if (!out) {
+			perror(record);
+			return;
+		}
+	}
+
+	if (live) {
+		if (stmpe_detect() != 0x0811) {
+			printf("\n\nTEST FAILED\nUnexpected chip id, should be 0x0811\n\n");
+			return;
+		}
+		touch_setup();
+		printf("  Draw on the screen, stops after %d samples or 10s without touch\n", T2P_SAMPLES);
+	}
+
+	display_setup();
+	init_display();
+	fill_display(0);
+
+	lat_reset(&t2p_read);
+	lat_reset(&t2p_queue);
+	lat_reset(&t2p_wire);
+	lat_reset(&t2p_total);
+
+	t_irq = now_us();
+	for (i = 0; i < T2P_SAMPLES; i++) {
+		if (live)
+			n = t2p_next_live(pts, &t_irq);
+		else
+			n = t2p_next(in, i, pts, &t_irq);
+		if (!n)
+			break;
+		t_read = now_us();
+
+		draw_marker(&pts[n - 1]);
+		t_queued = now_us();
+		lcd_flush();
+		t_wire = now_us();
+
+		lat_add(&t2p_read, t_read - t_irq);
+		lat_add(&t2p_queue, t_queued - t_read);
+		lat_add(&t2p_wire, t_wire - t_queued);
+		lat_add(&t2p_total, t_wire - t_irq);
+
+		if (out) {
+			fprintf(out, "%llu %d %d %d\n", last ? (unsigned long long)(t_irq - last) : 0ULL,
+				pts[n - 1].x, pts[n - 1].y, pts[n - 1].z);
+			last = t_irq;
+		}
+	}
+
+	lat_report(&t2p_read);
+	lat_report(&t2p_queue);
+	lat_report(&t2p_wire);
+	lat_report(&t2p_total);
+
+	display_release();
+	if (in)
+		fclose(in);
+	if (out)
+		fclose(out);
+}
+
+void usage(const char *prog)
+{
+	printf("usage: %s [-v] [-n] [-q] [-b mask] [-w] [-t] [-l source [-o file]] [-r deg] [-R] [-e pin] [-p] [-s] [-c id] [-i] [-a pack]\n", prog);
+	printf("  -v       verbose\n");
+	printf("  -n       disable the register cache\n");
+	printf("  -q       send each command and data phase right away\n");
+	printf("  -b mask  benchmark single and bulk GPIO expander writes on the pins in mask\n");
+	printf("  -w       benchmark display updates with and without window reuse\n");
+	printf("  -t       touch latency under full screen animation, with and without chunking\n");
+	printf("  -l src   touch to photon latency, src is live, sim or a recording\n");
+	printf("  -o file  record the live touch samples to file\n");
+	printf("  -r deg   display rotation, 0, 90, 180 or 270\n");
+	printf("  -R       benchmark hardware and software rotation\n");
+	printf("  -e pin   benchmark tearing effect sync with TE on GPIO pin, or sim\n");
+	printf("  -p       benchmark frame preparation on 1, 2 and 4 threads\n");
+	printf("  -s       run as panel server, sharing the display with clients\n");
+	printf("  -c id    run as a client of the panel server, draws a box\n");
+	printf("  -i       benchmark indexed color against RGB565 frames\n");
+	printf("  -a pack  benchmark drawing the assets in a pitft_pack file against raw blits\n");
+	printf("Without a benchmark option the display and touch tests are run.\n");
+}
 
 int main(int argc, char **argv)
 {
-	if (argc > 1) {
-		if (!strcmp(argv[1], "-v"))
+	int gpio_bench_mask = -1;
+	int do_win_bench = 0;
+	int do_touch_sched = 0;
+	char *t2p_source = NULL;
+	char *t2p_record = NULL;
+	int do_rot_bench = 0;
+	int do_te_bench = 0;
+	int do_prep_bench = 0;
+	int do_server = 0;
+	int client_id = -1;
+	int do_idx_bench = 0;
+	char *asset_path = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "vnqb:wtl:o:r:Re:psc:ia:")) != -1) {
+		switch (opt) {
+		case 'v':
 			verbose = 1;
-		else {
-			printf("unknown argument, only -v for verbose supported\n");
+			break;
+		case 'n':
+			reg_cache_enabled = 0;
+			break;
+		case 'q':
+			cmdq_enabled = 0;
+			break;
+		case 'b':
+			gpio_bench_mask = strtoul(optarg, NULL, 0) & 0xFF;
+			break;
+		case 'w':
+			do_win_bench = 1;
+			break;
+		case 't':
+			do_touch_sched = 1;
+			break;
+		case 'l':
+			t2p_source = optarg;
+			break;
+		case 'o':
+			t2p_record = optarg;
+			break;
+		case 'r':
+			lcd_rotate = atoi(optarg);
+			if (lcd_rotate % 90 || lcd_rotate < 0 || lcd_rotate > 270) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'R':
+			do_rot_bench = 1;
+			break;
+		case 'e':
+			te_pin = strcmp(optarg, "sim") ? atoi(optarg) : -1;
+			do_te_bench = 1;
+			break;
+		case 'p':
+			do_prep_bench = 1;
+			break;
+		case 's':
+			do_server = 1;
+			break;
+		case 'c':
+			client_id = atoi(optarg);
+			break;
+		case 'i':
+			do_idx_bench = 1;
+			break;
+		case 'a':
+			asset_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
 			return 1;
 		}
 	}
+	/* clients don't touch the hardware */
+	if (client_id >= 0)
+		return shm_client(client_id);
+
 	printf("PiTFT test utility by Noralf Tronnes\n");
 	if (!bcm2835_init())
 		return 1;
 
 	bcm2835_spi_begin();
 
-	display_test();
-	touch_test();
+	if (gpio_bench_mask >= 0 || do_win_bench || do_touch_sched || t2p_source ||
+	    do_rot_bench || do_te_bench || do_prep_bench || do_server ||
+	    do_idx_bench || asset_path) {
+		if (gpio_bench_mask >= 0)
+			gpio_bench(gpio_bench_mask);
+		if (do_win_bench)
+			win_bench();
+		if (do_touch_sched)
+			touch_sched_bench();
+		if (t2p_source)
+			t2p_bench(t2p_source, t2p_record);
+		if (do_rot_bench)
+			rot_bench();
+		if (do_te_bench)
+			te_bench();
+		if (do_prep_bench)
+			prep_bench();
+		if (do_idx_bench)
+			idx_bench();
+		if (asset_path)
+			asset_bench(asset_path);
+		if (do_server)
+			shm_server();
+	} else {
+		display_test();
+		touch_test();
+	}
+
+	printf("\nRegister cache%s\n", reg_cache_enabled ? "" : " (disabled)");
+	reg_cache_report(&lcd_cache);
+	reg_cache_report(&stmpe_cache);
+	printf("\nCommand queue%s\n", cmdq_enabled ? "" : " (disabled)");
+	cmdq_report();
 
 	bcm2835_close();
 
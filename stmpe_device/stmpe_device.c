@@ -24,11 +24,37 @@
 #include <linux/delay.h>
 #include <linux/interrupt.h>
 #include <linux/io.h>
+#include <linux/input.h>
+#include <linux/irqdomain.h>
+#include <linux/iio/iio.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/trigger.h>
+#include <linux/iio/trigger_consumer.h>
+#include <linux/iio/triggered_buffer.h>
+#include <linux/lockdep.h>
+#include <linux/math64.h>
 #include <linux/mfd/stmpe.h>
+#include <linux/slab.h>
 #include <linux/spi/spi.h>
+#include <linux/spinlock.h>
+#include <linux/gpio.h>
+#include <linux/gpio/driver.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/tracepoint.h>
+#include <linux/workqueue.h>
 
 #define DRVNAME "stmpe_device"
 
+#define CREATE_TRACE_POINTS
+#include "stmpe_device_trace.h"
+
+#define LATENCY_TRACE_IRQ(irq)		trace_stmpe_device_irq(irq)
+#define LATENCY_TRACE_EVENT(ns)		trace_stmpe_device_event(ns)
+#include "latency_stats.h"
+#include "touch_calib.h"
+
 static unsigned int verbose = 0;
 module_param(verbose, uint, 0);
 MODULE_PARM_DESC(verbose, "0-2");
@@ -50,6 +76,18 @@ static int mode = SPI_MODE_0;
 module_param(mode, int, 0);
 MODULE_PARM_DESC(mode, "SPI mode (default: SPI_MODE_0)");
 
+static bool autoprobe = false;
+module_param(autoprobe, bool, 0);
+MODULE_PARM_DESC(autoprobe, "stmpe811: find the SPI mode and fastest speed at load time, 'mode' is preferred on a tie");
+
+static unsigned autoprobe_max_speed = 1000 * 1000;
+module_param(autoprobe_max_speed, uint, 0);
+MODULE_PARM_DESC(autoprobe_max_speed, "Highest SPI speed tried by autoprobe (default: 1MHz)");
+
+static unsigned autoprobe_tries = 10;
+module_param(autoprobe_tries, uint, 0);
+MODULE_PARM_DESC(autoprobe_tries, "Chip ID and register readbacks that must succeed for each setting (default: 10)");
+
 /* Base arguments */
 static char *chip;
 module_param(chip, charp, 0);
@@ -57,7 +95,7 @@ MODULE_PARM_DESC(chip, "Chip - modalias field");
 
 static char *blocks;
 module_param(blocks, charp, 0);
-MODULE_PARM_DESC(blocks, "List of blocks to use (supported: gpio,ts)");
+MODULE_PARM_DESC(blocks, "List of blocks to use (supported: gpio,ts,adc,temp,pwm)");
 
 static int irq_base;
 module_param(irq_base, int, 0);
@@ -127,6 +165,37 @@ static unsigned i_drive;
 module_param(i_drive, uint, 0);
 MODULE_PARM_DESC(i_drive, "current limit value of the touchscreen drivers (default: 0 -> 20 mA typical 35 mA max)");
 
+static unsigned fifo_th;
+module_param(fifo_th, uint, 0);
+MODULE_PARM_DESC(fifo_th, "Batched mode: FIFO threshold, samples read per interrupt (2-64, default: 0 -> use stmpe-ts)");
+
+/* ADC and temperature blocks */
+static unsigned adc_channels = 0x0f;
+module_param(adc_channels, uint, 0);
+MODULE_PARM_DESC(adc_channels, "bitmask of ADC channels to expose, 4-7 are used by the touchscreen (default: 0x0f)");
+
+static unsigned adc_rate = 100;
+module_param(adc_rate, uint, 0);
+MODULE_PARM_DESC(adc_rate, "Sample rate in Hz for the buffered adc/temp readings (default: 100)");
+
+static unsigned adc_vref_mv = 3300;
+module_param(adc_vref_mv, uint, 0);
+MODULE_PARM_DESC(adc_vref_mv, "ADC reference voltage in mV (default: 3300)");
+
+static unsigned xres = 320;
+module_param(xres, uint, 0);
+MODULE_PARM_DESC(xres, "Screen width used by the calibrated device (default: 320)");
+
+static unsigned yres = 240;
+module_param(yres, uint, 0);
+MODULE_PARM_DESC(yres, "Screen height used by the calibrated device (default: 240)");
+
+static bool latency_stats = false;
+module_param(latency_stats, bool, 0);
+MODULE_PARM_DESC(latency_stats, "Collect IRQ to input event latency statistics in debugfs");
+
+
+#define TS_BATCH_MAX	64
 
 #define pr_pdata(sym)  pr_info(DRVNAME":   "#sym" = %d\n", pdata->sym)
 
@@ -141,6 +210,1193 @@ static struct spi_board_info stmpe_device = {
 
 struct spi_device *stmpe_spi_device = NULL;
 
+static bool stmpe_device_match_input(struct input_dev *dev)
+{
+	struct device *parent;
+
+	if (!stmpe_spi_device)
+		return false;
+
+	/* stmpe-ts is a child of the mfd device */
+	for (parent = dev->dev.parent; parent; parent = parent->parent)
+		if (parent == &stmpe_spi_device->dev)
+			return true;
+
+	return false;
+}
+
+static int stmpe_device_connect(struct input_handler *handler, struct input_dev *dev,
+				const struct input_device_id *id)
+{
+	struct input_handle *handle;
+	int ret;
+
+	handle = kzalloc(sizeof(*handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
+
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = handler->name;
+
+	ret = input_register_handle(handle);
+	if (ret)
+		goto err_free;
+
+	ret = input_open_device(handle);
+	if (ret)
+		goto err_unregister;
+
+	if (verbose)
+		pr_info(DRVNAME": %s: connected to '%s'\n", handler->name, dev->name);
+
+	return 0;
+
+err_unregister:
+	input_unregister_handle(handle);
+err_free:
+	kfree(handle);
+	return ret;
+}
+
+static void stmpe_device_disconnect(struct input_handle *handle)
+{
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+static const struct input_device_id stmpe_device_ids[] = {
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT | INPUT_DEVICE_ID_MATCH_ABSBIT,
+		.evbit = { BIT_MASK(EV_ABS) },
+		.absbit = { [BIT_WORD(ABS_X)] = BIT_MASK(ABS_X) | BIT_MASK(ABS_Y) },
+	},
+	{ },
+};
+
+/* the mfd driver has to be bound for the register access functions */
+static struct stmpe *stmpe_device_get_stmpe(void)
+{
+	if (!stmpe_spi_device || !stmpe_spi_device->dev.driver) {
+		pr_err(DRVNAME": %s is not bound to the stmpe driver\n", chip);
+		return NULL;
+	}
+
+	return dev_get_drvdata(&stmpe_spi_device->dev);
+}
+
+/*
+ * Calibration
+ *
+ * See touch_calib.h, the stmpe-ts input device is the one calibrated.
+ */
+
+static bool calib_match(struct input_handler *handler, struct input_dev *dev)
+{
+	return dev != calib_input && stmpe_device_match_input(dev);
+}
+
+static struct input_handler calib_handler = {
+	.filter		= calib_filter,
+	.match		= calib_match,
+	.connect	= stmpe_device_connect,
+	.disconnect	= stmpe_device_disconnect,
+	.name		= DRVNAME"-calibration",
+	.id_table	= stmpe_device_ids,
+};
+
+/*
+ * Latency statistics
+ *
+ * See latency_stats.h, the interrupt to the host is timestamped through the
+ * irq_handler_entry tracepoint. GPIO block interrupts that don't result in
+ * a touch event are counted as spurious.
+ */
+
+static int latency_irq_num;
+static struct dentry *debugfs_dir;
+
+/* the calibration filter swallows the raw events, so look at both */
+static bool latency_match(struct input_handler *handler, struct input_dev *dev)
+{
+	return (calib_input && dev == calib_input) || stmpe_device_match_input(dev);
+}
+
+static struct input_handler latency_handler = {
+	.event		= latency_input_event,
+	.match		= latency_match,
+	.connect	= stmpe_device_connect,
+	.disconnect	= stmpe_device_disconnect,
+	.name		= DRVNAME"-latency",
+	.id_table	= stmpe_device_ids,
+};
+
+static int latency_register(int irq)
+{
+	int ret;
+
+	latency_irq_num = irq;
+	ret = latency_probe_irqs(&latency_irq_num, irq > 0);
+	if (ret)
+		return ret;
+
+	ret = input_register_handler(&latency_handler);
+	if (ret) {
+		pr_err(DRVNAME": input_register_handler() returned %d\n", ret);
+		latency_unprobe_irqs();
+		return ret;
+	}
+
+	debugfs_create_file("latency", 0644, debugfs_dir, NULL, &latency_fops);
+
+	return 0;
+}
+
+static void latency_unregister(void)
+{
+	if (!latency_stats)
+		return;
+
+	input_unregister_handler(&latency_handler);
+	latency_unprobe_irqs();
+}
+/*
+ * Batched touchscreen
+ *
+ * With fifo_th > 1 the stmpe-ts driver is not used. The touchscreen is
+ * set up here with the FIFO threshold raised, so one FIFO_TH interrupt
+ * brings fifo_th samples which are drained in a single SPI burst from the
+ * non auto-incrementing TSC_DATA register. Pen up is detected by polling
+ * TSC_CTRL when the interrupts stop, like stmpe-ts does.
+ * The first sample of a touch is delayed by fifo_th sample periods.
+ * Interrupts, SPI transfers and samples per second of touch are shown in
+ * /sys/kernel/debug/stmpe_device/ts. Writing to the file resets it.
+ */
+
+#define STMPE811_IRQ_FIFO_TH		1
+#define STMPE811_REG_ADC_CTRL1		0x20
+#define STMPE811_REG_ADC_CTRL2		0x21
+#define STMPE811_REG_TSC_CTRL		0x40
+#define STMPE811_REG_TSC_CFG		0x41
+#define STMPE811_REG_FIFO_TH		0x4A
+#define STMPE811_REG_FIFO_STA		0x4B
+#define STMPE811_REG_FIFO_SIZE		0x4C
+#define STMPE811_REG_TSC_FRACTION_Z	0x56
+#define STMPE811_REG_TSC_I_DRIVE	0x58
+#define STMPE811_REG_TSC_DATA		0xD7
+#define STMPE811_TSC_CTRL_EN		BIT(0)
+#define STMPE811_TSC_CTRL_STA		BIT(7)
+#define STMPE811_FIFO_STA_RESET		BIT(0)
+#define STMPE_SPI_READ			BIT(7)
+
+#define TS_BATCH_RELEASE_MS		20
+
+struct ts_batch_stats {
+	u64 irqs;
+	u64 transfers;
+	u64 samples;
+	u64 touch_ns;
+	ktime_t down_time;
+	bool down;
+};
+
+static DEFINE_MUTEX(ts_batch_lock);
+static struct ts_batch_stats ts_batch;
+static struct stmpe *ts_stmpe;
+static struct input_dev *ts_input;
+static int ts_irq;
+static u8 *ts_tx, *ts_rx;
+static struct delayed_work ts_release_work;
+
+/* one transfer: the data for each address byte comes back in the next byte */
+static int ts_batch_drain(unsigned n)
+{
+	struct spi_transfer t = {
+		.tx_buf = ts_tx,
+		.rx_buf = ts_rx,
+		.len = n * 4 + 1,
+	};
+	struct spi_message m;
+	u8 *d;
+	int ret;
+
+	if (!n)
+		return 0;
+
+	memset(ts_tx, STMPE_SPI_READ | STMPE811_REG_TSC_DATA, n * 4);
+	ts_tx[n * 4] = 0x00;
+	spi_message_init(&m);
+	spi_message_add_tail(&t, &m);
+
+	mutex_lock(&ts_stmpe->lock);
+	ret = spi_sync(stmpe_spi_device, &m);
+	mutex_unlock(&ts_stmpe->lock);
+	ts_batch.transfers++;
+	if (ret) {
+		pr_err(DRVNAME": ts: spi_sync() returned %d\n", ret);
+		return ret;
+	}
+
+	if (!ts_batch.down) {
+		ts_batch.down_time = ktime_get();
+		ts_batch.down = true;
+	}
+
+	for (d = ts_rx + 1; n; n--, d += 4) {
+		input_report_abs(ts_input, ABS_X, (d[0] << 4) | (d[1] >> 4));
+		input_report_abs(ts_input, ABS_Y, ((d[1] & 0xf) << 8) | d[2]);
+		input_report_abs(ts_input, ABS_PRESSURE, d[3]);
+		input_report_key(ts_input, BTN_TOUCH, 1);
+		input_sync(ts_input);
+		ts_batch.samples++;
+	}
+
+	return 0;
+}
+
+static void ts_batch_reset_fifo(void)
+{
+	stmpe_set_bits(ts_stmpe, STMPE811_REG_FIFO_STA, STMPE811_FIFO_STA_RESET, STMPE811_FIFO_STA_RESET);
+	stmpe_set_bits(ts_stmpe, STMPE811_REG_FIFO_STA, STMPE811_FIFO_STA_RESET, 0);
+}
+
+static irqreturn_t ts_batch_irq(int irq, void *data)
+{
+	mutex_lock(&ts_batch_lock);
+	ts_batch.irqs++;
+	ts_batch_drain(fifo_th);
+	mutex_unlock(&ts_batch_lock);
+
+	mod_delayed_work(system_wq, &ts_release_work, msecs_to_jiffies(TS_BATCH_RELEASE_MS));
+
+	return IRQ_HANDLED;
+}
+
+static void ts_batch_release(struct work_struct *work)
+{
+	int ctrl, size;
+
+	mutex_lock(&ts_batch_lock);
+
+	ctrl = stmpe_reg_read(ts_stmpe, STMPE811_REG_TSC_CTRL);
+	ts_batch.transfers++;
+	if (ctrl >= 0 && (ctrl & STMPE811_TSC_CTRL_STA)) {
+		/* still touching, but less than fifo_th samples since the last interrupt */
+		schedule_delayed_work(&ts_release_work, msecs_to_jiffies(TS_BATCH_RELEASE_MS));
+		goto out;
+	}
+
+	size = stmpe_reg_read(ts_stmpe, STMPE811_REG_FIFO_SIZE);
+	ts_batch.transfers++;
+	if (size > 0)
+		ts_batch_drain(min_t(int, size, fifo_th));
+	ts_batch_reset_fifo();
+
+	input_report_abs(ts_input, ABS_PRESSURE, 0);
+	input_report_key(ts_input, BTN_TOUCH, 0);
+	input_sync(ts_input);
+
+	if (ts_batch.down) {
+		ts_batch.touch_ns += ktime_to_ns(ktime_sub(ktime_get(), ts_batch.down_time));
+		ts_batch.down = false;
+	}
+out:
+	mutex_unlock(&ts_batch_lock);
+}
+
+static int ts_batch_open(struct input_dev *dev)
+{
+	ts_batch_reset_fifo();
+
+	return stmpe_set_bits(ts_stmpe, STMPE811_REG_TSC_CTRL, STMPE811_TSC_CTRL_EN, STMPE811_TSC_CTRL_EN);
+}
+
+static void ts_batch_close(struct input_dev *dev)
+{
+	cancel_delayed_work_sync(&ts_release_work);
+	stmpe_set_bits(ts_stmpe, STMPE811_REG_TSC_CTRL, STMPE811_TSC_CTRL_EN, 0);
+}
+
+/* the ADC settings are shared by the touchscreen and the ADC block */
+static int stmpe811_adc_config(struct stmpe *stmpe, struct stmpe_ts_platform_data *ts)
+{
+	int ret;
+
+	ret = stmpe_set_bits(stmpe, STMPE811_REG_ADC_CTRL1, 0xfa,
+			     ((ts->sample_time & 0xf) << 4) | ((ts->mod_12b & 0x1) << 3) | ((ts->ref_sel & 0x1) << 1));
+	if (ret)
+		return ret;
+
+	return stmpe_set_bits(stmpe, STMPE811_REG_ADC_CTRL2, 0x03, ts->adc_freq & 0x3);
+}
+
+static int ts_batch_init_hw(struct stmpe_ts_platform_data *ts)
+{
+	struct stmpe *stmpe = ts_stmpe;
+	int ret;
+
+	ret = stmpe_enable(stmpe, STMPE_BLOCK_TOUCHSCREEN | STMPE_BLOCK_ADC);
+	if (ret)
+		return ret;
+
+	/* same register setup as stmpe-ts, except for the FIFO threshold */
+	ret = stmpe811_adc_config(stmpe, ts);
+	if (!ret)
+		ret = stmpe_set_bits(stmpe, STMPE811_REG_TSC_CFG, 0xff,
+				     ((ts->ave_ctrl & 0x3) << 6) | ((ts->touch_det_delay & 0x7) << 3) | (ts->settling & 0x7));
+	if (!ret)
+		ret = stmpe_set_bits(stmpe, STMPE811_REG_TSC_FRACTION_Z, 0x07, ts->fraction_z & 0x7);
+	if (!ret)
+		ret = stmpe_set_bits(stmpe, STMPE811_REG_TSC_I_DRIVE, 0x01, ts->i_drive & 0x1);
+	if (!ret)
+		ret = stmpe_reg_write(stmpe, STMPE811_REG_FIFO_TH, fifo_th);
+	/* OP_MOD_XYZ */
+	if (!ret)
+		ret = stmpe_set_bits(stmpe, STMPE811_REG_TSC_CTRL, 0x0e, 0);
+	if (ret) {
+		pr_err(DRVNAME": ts: failed to configure the touchscreen: %d\n", ret);
+		stmpe_disable(stmpe, STMPE_BLOCK_TOUCHSCREEN | STMPE_BLOCK_ADC);
+	}
+
+	return ret;
+}
+
+static int ts_batch_show(struct seq_file *m, void *v)
+{
+	struct ts_batch_stats s;
+	u64 touch_ns;
+
+	mutex_lock(&ts_batch_lock);
+	s = ts_batch;
+	mutex_unlock(&ts_batch_lock);
+
+	touch_ns = s.touch_ns;
+	if (s.down)
+		touch_ns += ktime_to_ns(ktime_sub(ktime_get(), s.down_time));
+
+	seq_printf(m, "fifo_th:   %u\n", fifo_th);
+	seq_printf(m, "touch:     %llu ms\n", div_u64(touch_ns, NSEC_PER_MSEC));
+	seq_printf(m, "irqs:      %llu\n", s.irqs);
+	seq_printf(m, "transfers: %llu\n", s.transfers);
+	seq_printf(m, "samples:   %llu\n", s.samples);
+	if (touch_ns) {
+		seq_printf(m, "irqs/s:      %llu\n", div64_u64(s.irqs * NSEC_PER_SEC, touch_ns));
+		seq_printf(m, "transfers/s: %llu\n", div64_u64(s.transfers * NSEC_PER_SEC, touch_ns));
+		seq_printf(m, "samples/s:   %llu\n", div64_u64(s.samples * NSEC_PER_SEC, touch_ns));
+	}
+
+	return 0;
+}
+
+static int ts_batch_debugfs_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ts_batch_show, NULL);
+}
+
+static ssize_t ts_batch_write(struct file *file, const char __user *buf,
+			      size_t count, loff_t *ppos)
+{
+	mutex_lock(&ts_batch_lock);
+	memset(&ts_batch, 0, sizeof(ts_batch));
+	mutex_unlock(&ts_batch_lock);
+
+	return count;
+}
+
+static const struct file_operations ts_batch_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ts_batch_debugfs_open,
+	.read		= seq_read,
+	.write		= ts_batch_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int ts_batch_register(struct stmpe_ts_platform_data *ts)
+{
+	int ret;
+
+	if (fifo_th > TS_BATCH_MAX) {
+		pr_err(DRVNAME": fifo_th can't be larger than %d\n", TS_BATCH_MAX);
+		return -EINVAL;
+	}
+
+	ts_stmpe = stmpe_device_get_stmpe();
+	if (!ts_stmpe)
+		return -ENODEV;
+	if (ts_stmpe->partnum != STMPE811 && ts_stmpe->partnum != STMPE610) {
+		pr_err(DRVNAME": ts: batched mode is only supported on the stmpe811/610\n");
+		return -EINVAL;
+	}
+
+	ts_tx = kmalloc(TS_BATCH_MAX * 4 + 1, GFP_KERNEL);
+	ts_rx = kmalloc(TS_BATCH_MAX * 4 + 1, GFP_KERNEL);
+	if (!ts_tx || !ts_rx) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	INIT_DELAYED_WORK(&ts_release_work, ts_batch_release);
+
+	ret = ts_batch_init_hw(ts);
+	if (ret)
+		goto err_free;
+
+	ts_input = input_allocate_device();
+	if (!ts_input) {
+		ret = -ENOMEM;
+		goto err_disable;
+	}
+
+	ts_input->name = "stmpe-ts";
+	ts_input->phys = DRVNAME"/input1";
+	ts_input->id.bustype = BUS_SPI;
+	ts_input->dev.parent = &stmpe_spi_device->dev;
+	ts_input->open = ts_batch_open;
+	ts_input->close = ts_batch_close;
+
+	input_set_capability(ts_input, EV_KEY, BTN_TOUCH);
+	input_set_abs_params(ts_input, ABS_X, 0, 0xfff, 0, 0);
+	input_set_abs_params(ts_input, ABS_Y, 0, 0xfff, 0, 0);
+	input_set_abs_params(ts_input, ABS_PRESSURE, 0, 0xff, 0, 0);
+
+	ret = input_register_device(ts_input);
+	if (ret) {
+		pr_err(DRVNAME": input_register_device() returned %d\n", ret);
+		input_free_device(ts_input);
+		goto err_disable;
+	}
+
+	ts_irq = irq_create_mapping(ts_stmpe->domain, STMPE811_IRQ_FIFO_TH);
+	if (!ts_irq) {
+		pr_err(DRVNAME": ts: failed to map the FIFO_TH interrupt\n");
+		ret = -EINVAL;
+		goto err_input;
+	}
+
+	/* nested in the stmpe interrupt thread */
+	ret = request_threaded_irq(ts_irq, NULL, ts_batch_irq, IRQF_ONESHOT, "stmpe-ts-batch", NULL);
+	if (ret) {
+		pr_err(DRVNAME": ts: request_threaded_irq(%d) returned %d\n", ts_irq, ret);
+		goto err_input;
+	}
+
+	debugfs_create_file("ts", 0644, debugfs_dir, NULL, &ts_batch_fops);
+
+	if (verbose)
+		pr_info(DRVNAME": ts: batched mode, %u samples per interrupt\n", fifo_th);
+
+	return 0;
+
+err_input:
+	input_unregister_device(ts_input);
+err_disable:
+	stmpe_disable(ts_stmpe, STMPE_BLOCK_TOUCHSCREEN | STMPE_BLOCK_ADC);
+err_free:
+	kfree(ts_tx);
+	kfree(ts_rx);
+	ts_input = NULL;
+	return ret;
+}
+
+static void ts_batch_unregister(void)
+{
+	if (!ts_input)
+		return;
+
+	free_irq(ts_irq, NULL);
+	input_unregister_device(ts_input);
+	cancel_delayed_work_sync(&ts_release_work);
+	stmpe_disable(ts_stmpe, STMPE_BLOCK_TOUCHSCREEN | STMPE_BLOCK_ADC);
+	kfree(ts_tx);
+	kfree(ts_rx);
+	ts_input = NULL;
+}
+
+/*
+ * ADC and temperature sensor
+ *
+ * The adc and temp blocks are exposed as an IIO device with a triggered
+ * buffer. The trigger is a hrtimer running at adc_rate Hz while the
+ * buffer is enabled, and each trigger converts all enabled channels with
+ * one ADC_CAPT write and reads the results back in one block read.
+ * The rate can be changed through the sampling_frequency attribute.
+ * Single values can still be read from the in_*_raw files.
+ */
+
+#define STMPE811_REG_SYS_CTRL2		0x04
+#define STMPE811_REG_GPIO_AF		0x17
+#define STMPE811_REG_ADC_CAPT		0x22
+#define STMPE811_REG_ADC_DATA_CH(ch)	(0x30 + (ch) * 2)
+#define STMPE811_REG_TEMP_CTRL		0x60
+#define STMPE811_REG_TEMP_DATA		0x61
+#define STMPE811_SYS_CTRL2_TS_OFF	BIT(3)
+#define STMPE811_TEMP_CTRL_EN		BIT(0)
+#define STMPE811_TEMP_CTRL_ACQ		BIT(1)
+
+#define SENSORS_ADC_CHANNELS		8
+#define SENSORS_TEMP			SENSORS_ADC_CHANNELS
+#define SENSORS_CONV_TRIES		20
+#define SENSORS_RATE_MAX		1000
+
+static DEFINE_MUTEX(sensors_lock);
+static struct stmpe *sensors_stmpe;
+static struct iio_dev *sensors_iio;
+static struct iio_trigger *sensors_trig;
+static struct hrtimer sensors_timer;
+static struct iio_chan_spec *sensors_channels;
+static unsigned int sensors_adc_mask;
+static bool sensors_temp;
+static bool sensors_own_adc;
+/* room for all channels and the timestamp */
+static u16 sensors_scan[16] __aligned(8);
+
+static int sensors_convert_adc(unsigned int mask, u16 *vals)
+{
+	struct stmpe *stmpe = sensors_stmpe;
+	u8 buf[SENSORS_ADC_CHANNELS * 2];
+	int first = __ffs(mask), last = __fls(mask);
+	int i, ret;
+
+	ret = stmpe_reg_write(stmpe, STMPE811_REG_ADC_CAPT, mask);
+	if (ret)
+		return ret;
+
+	/* a bit reads back as 1 when its conversion is done */
+	for (i = 0; i < SENSORS_CONV_TRIES; i++) {
+		ret = stmpe_reg_read(stmpe, STMPE811_REG_ADC_CAPT);
+		if (ret < 0)
+			return ret;
+		if ((ret & mask) == mask)
+			break;
+		usleep_range(50, 100);
+	}
+	if (i == SENSORS_CONV_TRIES)
+		return -ETIMEDOUT;
+
+	ret = stmpe_block_read(stmpe, STMPE811_REG_ADC_DATA_CH(first), (last - first + 1) * 2, buf);
+	if (ret < 0)
+		return ret;
+
+	for (i = first; i <= last; i++)
+		vals[i] = ((buf[(i - first) * 2] << 8) | buf[(i - first) * 2 + 1]) & 0xfff;
+
+	return 0;
+}
+
+static int sensors_convert_temp(u16 *val)
+{
+	struct stmpe *stmpe = sensors_stmpe;
+	u8 buf[2];
+	int i, ret;
+
+	ret = stmpe_reg_write(stmpe, STMPE811_REG_TEMP_CTRL, STMPE811_TEMP_CTRL_EN | STMPE811_TEMP_CTRL_ACQ);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < SENSORS_CONV_TRIES; i++) {
+		usleep_range(100, 200);
+		ret = stmpe_reg_read(stmpe, STMPE811_REG_TEMP_CTRL);
+		if (ret < 0)
+			return ret;
+		if (!(ret & STMPE811_TEMP_CTRL_ACQ))
+			break;
+	}
+	if (i == SENSORS_CONV_TRIES)
+		return -ETIMEDOUT;
+
+	ret = stmpe_block_read(stmpe, STMPE811_REG_TEMP_DATA, 2, buf);
+	if (ret < 0)
+		return ret;
+
+	*val = ((buf[0] & 0x3) << 8) | buf[1];
+
+	return 0;
+}
+
+/* vals is indexed by the channel address, the temperature sensor is last */
+static int sensors_convert(unsigned int adc_mask, bool temp, u16 *vals)
+{
+	int ret = 0;
+
+	mutex_lock(&sensors_lock);
+	if (adc_mask)
+		ret = sensors_convert_adc(adc_mask, vals);
+	if (!ret && temp)
+		ret = sensors_convert_temp(&vals[SENSORS_TEMP]);
+	mutex_unlock(&sensors_lock);
+
+	return ret;
+}
+
+static irqreturn_t sensors_trigger_handler(int irq, void *p)
+{
+	struct iio_poll_func *pf = p;
+	struct iio_dev *indio_dev = pf->indio_dev;
+	u16 vals[SENSORS_ADC_CHANNELS + 1];
+	unsigned int adc_mask = 0;
+	bool temp = false;
+	int i, j = 0;
+
+	for_each_set_bit(i, indio_dev->active_scan_mask, indio_dev->masklength) {
+		if (sensors_channels[i].address == SENSORS_TEMP)
+			temp = true;
+		else
+			adc_mask |= BIT(sensors_channels[i].address);
+	}
+
+	if (sensors_convert(adc_mask, temp, vals))
+		goto out;
+
+	for_each_set_bit(i, indio_dev->active_scan_mask, indio_dev->masklength)
+		sensors_scan[j++] = vals[sensors_channels[i].address];
+
+	iio_push_to_buffers_with_timestamp(indio_dev, sensors_scan, pf->timestamp);
+out:
+	iio_trigger_notify_done(indio_dev->trig);
+
+	return IRQ_HANDLED;
+}
+
+static enum hrtimer_restart sensors_timer_func(struct hrtimer *timer)
+{
+	iio_trigger_poll(sensors_trig);
+	hrtimer_forward_now(timer, ns_to_ktime(div_u64(NSEC_PER_SEC, adc_rate)));
+
+	return HRTIMER_RESTART;
+}
+
+static int sensors_postenable(struct iio_dev *indio_dev)
+{
+	int ret;
+
+	ret = iio_triggered_buffer_postenable(indio_dev);
+	if (ret)
+		return ret;
+
+	hrtimer_start(&sensors_timer, ns_to_ktime(div_u64(NSEC_PER_SEC, adc_rate)), HRTIMER_MODE_REL);
+
+	return 0;
+}
+
+static int sensors_predisable(struct iio_dev *indio_dev)
+{
+	hrtimer_cancel(&sensors_timer);
+
+	return iio_triggered_buffer_predisable(indio_dev);
+}
+
+static const struct iio_buffer_setup_ops sensors_buffer_ops = {
+	.postenable = sensors_postenable,
+	.predisable = sensors_predisable,
+};
+
+static int sensors_read_raw(struct iio_dev *indio_dev, struct iio_chan_spec const *chan,
+			    int *val, int *val2, long mask)
+{
+	u16 vals[SENSORS_ADC_CHANNELS + 1];
+	int ret;
+
+	switch (mask) {
+	case IIO_CHAN_INFO_RAW:
+		if (iio_buffer_enabled(indio_dev))
+			return -EBUSY;
+		if (chan->address == SENSORS_TEMP)
+			ret = sensors_convert(0, true, vals);
+		else
+			ret = sensors_convert(BIT(chan->address), false, vals);
+		if (ret)
+			return ret;
+		*val = vals[chan->address];
+		return IIO_VAL_INT;
+	case IIO_CHAN_INFO_SCALE:
+		if (chan->type == IIO_TEMP) {
+			/* millidegrees: raw * 449960 / 1024 - 273150 */
+			*val = 449960;
+			*val2 = 1024;
+			return IIO_VAL_FRACTIONAL;
+		}
+		*val = adc_vref_mv;
+		*val2 = mod_12b ? 12 : 10;
+		return IIO_VAL_FRACTIONAL_LOG2;
+	case IIO_CHAN_INFO_OFFSET:
+		/* -273150 * 1024 / 449960 */
+		*val = -621;
+		*val2 = 623255;
+		return IIO_VAL_INT_PLUS_MICRO;
+	case IIO_CHAN_INFO_SAMP_FREQ:
+		*val = adc_rate;
+		return IIO_VAL_INT;
+	}
+
+	return -EINVAL;
+}
+
+static int sensors_write_raw(struct iio_dev *indio_dev, struct iio_chan_spec const *chan,
+			     int val, int val2, long mask)
+{
+	if (mask != IIO_CHAN_INFO_SAMP_FREQ)
+		return -EINVAL;
+	if (val < 1 || val > SENSORS_RATE_MAX || val2)
+		return -EINVAL;
+
+	/* picked up by the timer on the next period */
+	adc_rate = val;
+
+	return 0;
+}
+
+static const struct iio_info sensors_info = {
+	.driver_module = THIS_MODULE,
+	.read_raw = sensors_read_raw,
+	.write_raw = sensors_write_raw,
+};
+
+static int sensors_init_channels(void)
+{
+	struct iio_chan_spec *chan;
+	int num = hweight32(sensors_adc_mask) + sensors_temp + 1;
+	int ch, i = 0;
+
+	sensors_channels = kcalloc(num, sizeof(*sensors_channels), GFP_KERNEL);
+	if (!sensors_channels)
+		return -ENOMEM;
+
+	for (ch = 0; ch < SENSORS_ADC_CHANNELS; ch++) {
+		if (!(sensors_adc_mask & BIT(ch)))
+			continue;
+		chan = &sensors_channels[i];
+		chan->type = IIO_VOLTAGE;
+		chan->indexed = 1;
+		chan->channel = ch;
+		chan->address = ch;
+		chan->info_mask_separate = BIT(IIO_CHAN_INFO_RAW);
+		chan->info_mask_shared_by_type = BIT(IIO_CHAN_INFO_SCALE);
+		chan->info_mask_shared_by_all = BIT(IIO_CHAN_INFO_SAMP_FREQ);
+		chan->scan_index = i++;
+		chan->scan_type.sign = 'u';
+		chan->scan_type.realbits = 12;
+		chan->scan_type.storagebits = 16;
+		chan->scan_type.endianness = IIO_CPU;
+	}
+
+	if (sensors_temp) {
+		chan = &sensors_channels[i];
+		chan->type = IIO_TEMP;
+		chan->address = SENSORS_TEMP;
+		chan->info_mask_separate = BIT(IIO_CHAN_INFO_RAW) | BIT(IIO_CHAN_INFO_SCALE) | BIT(IIO_CHAN_INFO_OFFSET);
+		chan->info_mask_shared_by_all = BIT(IIO_CHAN_INFO_SAMP_FREQ);
+		chan->scan_index = i++;
+		chan->scan_type.sign = 'u';
+		chan->scan_type.realbits = 10;
+		chan->scan_type.storagebits = 16;
+		chan->scan_type.endianness = IIO_CPU;
+	}
+
+	chan = &sensors_channels[i];
+	chan->type = IIO_TIMESTAMP;
+	chan->channel = -1;
+	chan->scan_index = i;
+	chan->scan_type.sign = 's';
+	chan->scan_type.realbits = 64;
+	chan->scan_type.storagebits = 64;
+
+	return num;
+}
+
+static int sensors_init_hw(struct stmpe_ts_platform_data *ts)
+{
+	struct stmpe *stmpe = sensors_stmpe;
+	int ret;
+
+	if (sensors_adc_mask) {
+		/*
+		 * A set GPIO_AF bit selects GPIO on the stmpe811, and the
+		 * mfd core would set it for STMPE_BLOCK_ADC.
+		 */
+		ret = stmpe_set_bits(stmpe, STMPE811_REG_GPIO_AF, sensors_adc_mask, 0);
+		if (!ret)
+			ret = stmpe_enable(stmpe, STMPE_BLOCK_ADC);
+		/* the touchscreen has already set up the ADC */
+		if (!ret && sensors_own_adc)
+			ret = stmpe811_adc_config(stmpe, ts);
+		if (ret)
+			return ret;
+	}
+
+	if (sensors_temp) {
+		/* the mfd core doesn't know about the temperature sensor clock */
+		ret = stmpe_set_bits(stmpe, STMPE811_REG_SYS_CTRL2, STMPE811_SYS_CTRL2_TS_OFF, 0);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static void sensors_disable_hw(void)
+{
+	if (sensors_temp) {
+		stmpe_reg_write(sensors_stmpe, STMPE811_REG_TEMP_CTRL, 0);
+		stmpe_set_bits(sensors_stmpe, STMPE811_REG_SYS_CTRL2, STMPE811_SYS_CTRL2_TS_OFF, STMPE811_SYS_CTRL2_TS_OFF);
+	}
+	if (sensors_adc_mask && sensors_own_adc)
+		stmpe_disable(sensors_stmpe, STMPE_BLOCK_ADC);
+}
+
+static int sensors_register(struct stmpe_ts_platform_data *ts, bool ts_enabled)
+{
+	struct iio_dev *indio_dev;
+	int num, ret;
+
+	if (adc_rate < 1 || adc_rate > SENSORS_RATE_MAX) {
+		pr_err(DRVNAME": adc_rate must be 1-%d\n", SENSORS_RATE_MAX);
+		return -EINVAL;
+	}
+
+	if (ts_enabled && (sensors_adc_mask & 0xf0)) {
+		pr_err(DRVNAME": ADC channels 4-7 are used by the touchscreen\n");
+		return -EINVAL;
+	}
+
+	sensors_stmpe = stmpe_device_get_stmpe();
+	if (!sensors_stmpe)
+		return -ENODEV;
+	if (sensors_stmpe->partnum != STMPE811) {
+		pr_err(DRVNAME": the adc and temp blocks are only supported on the stmpe811\n");
+		return -EINVAL;
+	}
+	sensors_own_adc = !ts_enabled;
+
+	ret = sensors_init_hw(ts);
+	if (ret) {
+		pr_err(DRVNAME": failed to set up the adc/temp blocks: %d\n", ret);
+		goto err_disable;
+	}
+
+	num = sensors_init_channels();
+	if (num < 0) {
+		ret = num;
+		goto err_disable;
+	}
+
+	indio_dev = iio_device_alloc(0);
+	if (!indio_dev) {
+		ret = -ENOMEM;
+		goto err_channels;
+	}
+
+	indio_dev->name = "stmpe811";
+	indio_dev->dev.parent = &stmpe_spi_device->dev;
+	indio_dev->info = &sensors_info;
+	indio_dev->modes = INDIO_DIRECT_MODE;
+	indio_dev->channels = sensors_channels;
+	indio_dev->num_channels = num;
+
+	sensors_trig = iio_trigger_alloc("%s-dev%d", indio_dev->name, indio_dev->id);
+	if (!sensors_trig) {
+		ret = -ENOMEM;
+		goto err_iio;
+	}
+	sensors_trig->dev.parent = &stmpe_spi_device->dev;
+
+	ret = iio_trigger_register(sensors_trig);
+	if (ret)
+		goto err_trig_free;
+	indio_dev->trig = iio_trigger_get(sensors_trig);
+
+	hrtimer_init(&sensors_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	sensors_timer.function = sensors_timer_func;
+
+	ret = iio_triggered_buffer_setup(indio_dev, &iio_pollfunc_store_time,
+					 &sensors_trigger_handler, &sensors_buffer_ops);
+	if (ret)
+		goto err_trig;
+
+	ret = iio_device_register(indio_dev);
+	if (ret) {
+		pr_err(DRVNAME": iio_device_register() returned %d\n", ret);
+		goto err_buffer;
+	}
+	sensors_iio = indio_dev;
+
+	if (verbose)
+		pr_info(DRVNAME": sensors: adc channels 0x%02x%s, %u Hz\n",
+			sensors_adc_mask, sensors_temp ? ", temperature" : "", adc_rate);
+
+	return 0;
+
+err_buffer:
+	iio_triggered_buffer_cleanup(indio_dev);
+err_trig:
+	iio_trigger_put(indio_dev->trig);
+	indio_dev->trig = NULL;
+	iio_trigger_unregister(sensors_trig);
+err_trig_free:
+	iio_trigger_free(sensors_trig);
+err_iio:
+	iio_device_free(indio_dev);
+err_channels:
+	kfree(sensors_channels);
+err_disable:
+	sensors_disable_hw();
+	return ret;
+}
+
+static void sensors_unregister(void)
+{
+	if (!sensors_iio)
+		return;
+
+	iio_device_unregister(sensors_iio);
+	iio_triggered_buffer_cleanup(sensors_iio);
+	iio_trigger_unregister(sensors_trig);
+	/* drops the reference to the trigger */
+	iio_device_free(sensors_iio);
+	iio_trigger_free(sensors_trig);
+	kfree(sensors_channels);
+	sensors_disable_hw();
+	sensors_iio = NULL;
+}
+
+/*
+ * GPIO bulk writes
+ *
+ * stmpe-gpio only implements the single pin set operation, so every pin
+ * change is a separate SPI transaction. A set_multiple operation is added
+ * to the gpiochip which writes each bank of the GPIO set/clear registers
+ * once for the whole mask. gpiolib uses it for array operations like
+ * gpiod_set_array_value() and the GPIO character device line handles.
+ * It's only added on the variants with separate set and clear registers
+ * where the higher banks are at lower addresses: stmpe811, stmpe1601 and
+ * stmpe24xx. The operation is removed again when the stmpe driver unbinds
+ * and on module exit, gpio_bulk_lock waits for calls in progress.
+ *
+ * Writing a pin mask to /sys/kernel/debug/stmpe_device/gpio_bench toggles
+ * those pins with single pin and bulk writes, reading the file shows the
+ * pins toggled per second. The pins should be configured as outputs.
+ */
+
+#define GPIO_BENCH_LOOPS	100
+
+struct gpio_bench_result {
+	unsigned long mask;
+	u64 single_ns;
+	u64 bulk_ns;
+	u64 toggles;
+};
+
+static DEFINE_MUTEX(gpio_bulk_lock);
+static struct gpio_bench_result gpio_bench;
+static struct gpio_chip *gpio_bulk_chip;
+static struct stmpe *gpio_bulk_stmpe;
+
+static void gpio_bulk_write(struct gpio_chip *chip, unsigned long *mask,
+			    unsigned long *bits)
+{
+	struct stmpe *stmpe = gpio_bulk_stmpe;
+	unsigned long set = *mask & *bits;
+	unsigned long clr = *mask & ~*bits;
+	int bank;
+
+	/* the registers for the higher banks are at lower addresses */
+	for (bank = 0; bank < DIV_ROUND_UP(chip->ngpio, 8); bank++) {
+		u8 s = set >> (bank * 8);
+		u8 c = clr >> (bank * 8);
+
+		if (s)
+			stmpe_reg_write(stmpe, stmpe->regs[STMPE_IDX_GPSR_LSB] - bank, s);
+		if (c)
+			stmpe_reg_write(stmpe, stmpe->regs[STMPE_IDX_GPCR_LSB] - bank, c);
+	}
+}
+
+static void gpio_bulk_set_multiple(struct gpio_chip *chip, unsigned long *mask,
+				   unsigned long *bits)
+{
+	int pin;
+
+	mutex_lock(&gpio_bulk_lock);
+	if (gpio_bulk_stmpe)
+		gpio_bulk_write(chip, mask, bits);
+	else
+		for_each_set_bit(pin, mask, chip->ngpio)
+			chip->set(chip, pin, test_bit(pin, bits));
+	mutex_unlock(&gpio_bulk_lock);
+}
+
+static int gpio_bench_show(struct seq_file *m, void *v)
+{
+	struct gpio_bench_result r;
+
+	mutex_lock(&gpio_bulk_lock);
+	r = gpio_bench;
+	mutex_unlock(&gpio_bulk_lock);
+
+	if (!r.toggles) {
+		seq_puts(m, "write a pin mask to run the benchmark\n");
+		return 0;
+	}
+
+	seq_printf(m, "mask:           0x%lx\n", r.mask);
+	seq_printf(m, "toggles:        %llu\n", r.toggles);
+	seq_printf(m, "single pins/s:  %llu\n", div64_u64(r.toggles * NSEC_PER_SEC, r.single_ns ?: 1));
+	seq_printf(m, "bulk pins/s:    %llu\n", div64_u64(r.toggles * NSEC_PER_SEC, r.bulk_ns ?: 1));
+
+	return 0;
+}
+
+static int gpio_bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, gpio_bench_show, NULL);
+}
+
+static ssize_t gpio_bench_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct gpio_chip *chip;
+	unsigned long mask, bits;
+	ktime_t start;
+	int i, pin, ret;
+
+	ret = kstrtoul_from_user(buf, count, 0, &mask);
+	if (ret)
+		return ret;
+
+	mutex_lock(&gpio_bulk_lock);
+	chip = gpio_bulk_chip;
+	if (!chip) {
+		mutex_unlock(&gpio_bulk_lock);
+		return -ENODEV;
+	}
+	mask &= BIT(chip->ngpio) - 1;
+	if (!mask) {
+		mutex_unlock(&gpio_bulk_lock);
+		return -EINVAL;
+	}
+
+	gpio_bench.mask = mask;
+	gpio_bench.toggles = (u64)GPIO_BENCH_LOOPS * 2 * hweight_long(mask);
+
+	start = ktime_get();
+	for (i = 0; i < GPIO_BENCH_LOOPS * 2; i++)
+		for_each_set_bit(pin, &mask, chip->ngpio)
+			chip->set(chip, pin, !(i & 1));
+	gpio_bench.single_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	start = ktime_get();
+	for (i = 0; i < GPIO_BENCH_LOOPS * 2; i++) {
+		bits = (i & 1) ? 0 : mask;
+		gpio_bulk_write(chip, &mask, &bits);
+	}
+	gpio_bench.bulk_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	mutex_unlock(&gpio_bulk_lock);
+
+	return count;
+}
+
+static const struct file_operations gpio_bench_fops = {
+	.owner		= THIS_MODULE,
+	.open		= gpio_bench_open,
+	.read		= seq_read,
+	.write		= gpio_bench_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int gpio_bulk_match(struct gpio_chip *chip, void *data)
+{
+	return chip->parent && chip->parent->parent == data;
+}
+
+static void gpio_bulk_remove(void)
+{
+	mutex_lock(&gpio_bulk_lock);
+	if (gpio_bulk_chip) {
+		/* calls in progress hold the lock, later ones use chip->set */
+		gpio_bulk_chip->set_multiple = NULL;
+		gpio_bulk_chip = NULL;
+		gpio_bulk_stmpe = NULL;
+	}
+	mutex_unlock(&gpio_bulk_lock);
+}
+
+/* the gpiochip goes away when the stmpe driver unbinds */
+static int gpio_bulk_notify(struct notifier_block *nb, unsigned long action, void *data)
+{
+	if (action == BUS_NOTIFY_UNBIND_DRIVER && data == &stmpe_spi_device->dev)
+		gpio_bulk_remove();
+
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block gpio_bulk_nb = {
+	.notifier_call = gpio_bulk_notify,
+};
+
+static bool gpio_bulk_notifier;
+
+static void gpio_bulk_register(void)
+{
+	struct gpio_chip *chip;
+	struct stmpe *stmpe;
+
+	stmpe = stmpe_device_get_stmpe();
+	if (!stmpe)
+		return;
+
+	switch (stmpe->partnum) {
+	case STMPE811:
+	case STMPE1601:
+	case STMPE2401:
+	case STMPE2403:
+		break;
+	default:
+		if (verbose)
+			pr_info(DRVNAME": no bulk writes for this register layout\n");
+		return;
+	}
+
+	chip = gpiochip_find(&stmpe_spi_device->dev, gpio_bulk_match);
+	if (!chip) {
+		pr_warning(DRVNAME": stmpe gpiochip not found, no bulk writes\n");
+		return;
+	}
+	if (chip->set_multiple) {
+		if (verbose)
+			pr_info(DRVNAME": gpiochip already has set_multiple\n");
+		return;
+	}
+
+	if (bus_register_notifier(&spi_bus_type, &gpio_bulk_nb)) {
+		pr_warning(DRVNAME": bus_register_notifier() failed, no bulk writes\n");
+		return;
+	}
+	gpio_bulk_notifier = true;
+
+	mutex_lock(&gpio_bulk_lock);
+	gpio_bulk_stmpe = stmpe;
+	gpio_bulk_chip = chip;
+	chip->set_multiple = gpio_bulk_set_multiple;
+	mutex_unlock(&gpio_bulk_lock);
+
+	debugfs_create_file("gpio_bench", 0644, debugfs_dir, NULL, &gpio_bench_fops);
+
+	if (verbose)
+		pr_info(DRVNAME": added set_multiple to gpiochip %d-%d\n",
+			chip->base, chip->base + chip->ngpio - 1);
+}
+
+static void gpio_bulk_unregister(void)
+{
+	gpio_bulk_remove();
+	if (gpio_bulk_notifier) {
+		bus_unregister_notifier(&spi_bus_type, &gpio_bulk_nb);
+		gpio_bulk_notifier = false;
+	}
+}
+
 #ifdef CONFIG_ARCH_BCM2708
 static void gpio_pull(unsigned pin, unsigned pud)
 {
@@ -232,11 +1488,143 @@ static int stmpe_device_spi_device_register(struct spi_board_info *spi)
 }
 #endif
 
+/*
+ * SPI autoprobe
+ *
+ * A temporary SPI device that no driver binds to is added on the chip
+ * select. For SPI mode 0 and 3 the speed is doubled from 500kHz up to
+ * autoprobe_max_speed for as long as the chip ID reads 0x0811 and a value
+ * written to FIFO_TH reads back, autoprobe_tries times in a row. Nothing
+ * is written in a setting before the chip ID has been read in it, and
+ * FIFO_TH is restored in the setting that is chosen. The real device gets the fastest setting found,
+ * and the stmpe mfd driver writes the mode to SPI_CFG when it probes.
+ */
+
+#define AUTOPROBE_MIN_SPEED	(500 * 1000)
+#define STMPE811_REG_CHIP_ID	0x00
+
+#ifdef MODULE
+static bool autoprobe_id_ok(struct spi_device *spi)
+{
+	return spi_w8r8(spi, STMPE_SPI_READ | STMPE811_REG_CHIP_ID) == 0x08 &&
+	       spi_w8r8(spi, STMPE_SPI_READ | (STMPE811_REG_CHIP_ID + 1)) == 0x11;
+}
+
+/*
+ * Nothing is written until the chip ID has been read in this setting.
+ * The original FIFO_TH value is read the first time, it's restored by the
+ * caller in the setting that is chosen.
+ */
+static bool autoprobe_check(struct spi_device *spi, int *orig)
+{
+	u8 tx[2];
+	int i, val;
+
+	if (!autoprobe_id_ok(spi))
+		return false;
+
+	if (*orig < 0) {
+		*orig = spi_w8r8(spi, STMPE_SPI_READ | STMPE811_REG_FIFO_TH);
+		if (*orig < 0)
+			return false;
+	}
+
+	for (i = 0; i < autoprobe_tries; i++) {
+		if (!autoprobe_id_ok(spi))
+			return false;
+
+		tx[0] = STMPE811_REG_FIFO_TH;
+		tx[1] = 0xA5 ^ i;
+		val = spi_write(spi, tx, 2) ? -1 : spi_w8r8(spi, STMPE_SPI_READ | STMPE811_REG_FIFO_TH);
+		if (val != tx[1])
+			return false;
+	}
+
+	return true;
+}
+
+static int autoprobe_spi(struct spi_board_info *info)
+{
+	static const int modes[] = { SPI_MODE_0, SPI_MODE_3 };
+	struct spi_board_info probe_info = *info;
+	unsigned best_speed = 0, hz;
+	struct spi_master *master;
+	struct spi_device *spi;
+	int i, best_mode = info->mode;
+	int orig = -1;
+	u8 tx[2];
+
+	master = spi_busnum_to_master(info->bus_num);
+	if (!master) {
+		pr_err(DRVNAME ":  spi_busnum_to_master(%d) returned NULL\n", info->bus_num);
+		return -EINVAL;
+	}
+
+	stmpe_device_spi_delete(master, info->chip_select);
+	strlcpy(probe_info.modalias, DRVNAME, sizeof(probe_info.modalias));
+	probe_info.platform_data = NULL;
+	probe_info.max_speed_hz = AUTOPROBE_MIN_SPEED;
+	spi = spi_new_device(master, &probe_info);
+	put_device(&master->dev);
+	if (!spi) {
+		pr_err(DRVNAME ":  autoprobe: spi_new_device() returned NULL\n");
+		return -EPERM;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(modes); i++) {
+		for (hz = AUTOPROBE_MIN_SPEED; hz <= autoprobe_max_speed; hz *= 2) {
+			spi->mode = modes[i];
+			spi->max_speed_hz = hz;
+			if (spi_setup(spi) || !autoprobe_check(spi, &orig))
+				break;
+			if (verbose)
+				pr_info(DRVNAME": autoprobe: mode %d at %ukHz ok\n", modes[i], hz / 1000);
+			if (hz > best_speed || (hz == best_speed && modes[i] == info->mode)) {
+				best_speed = hz;
+				best_mode = modes[i];
+			}
+		}
+	}
+
+	/* restore FIFO_TH in a setting that has passed */
+	if (best_speed && orig >= 0) {
+		spi->mode = best_mode;
+		spi->max_speed_hz = best_speed;
+		if (!spi_setup(spi)) {
+			tx[0] = STMPE811_REG_FIFO_TH;
+			tx[1] = orig;
+			spi_write(spi, tx, 2);
+		}
+	}
+
+	spi_unregister_device(spi);
+
+	if (!best_speed) {
+		pr_err(DRVNAME": autoprobe: no working SPI setting found, is there a stmpe811 on %d.%d?\n",
+		       info->bus_num, info->chip_select);
+		return -ENODEV;
+	}
+
+	info->mode = best_mode;
+	info->max_speed_hz = best_speed;
+	pr_info(DRVNAME": autoprobe: using SPI mode %d at %ukHz\n", best_mode, best_speed / 1000);
+
+	return 0;
+}
+#else
+static int autoprobe_spi(struct spi_board_info *info)
+{
+	pr_warning(DRVNAME": autoprobe is only supported when built as a module\n");
+	return 0;
+}
+#endif
+
 static int __init stmpe_device_init(void)
 {
 	struct stmpe_platform_data *pdata = &pdata_stmpe_device;
+	bool ts_enabled = false;
 	char *tmp;
-	int ret;
+	int ret, irq;
 
 	if (verbose)
 		pr_info(DRVNAME": %s()\n", __func__);
@@ -254,7 +1642,18 @@ static int __init stmpe_device_init(void)
 		if (strcmp(tmp, "gpio") == 0) {
 			pdata->blocks |= STMPE_BLOCK_GPIO;
 		} else if (strcmp(tmp, "ts") == 0) {
-			pdata->blocks |= STMPE_BLOCK_TOUCHSCREEN;
+			ts_enabled = true;
+			/* batched mode drives the touchscreen itself */
+			if (fifo_th < 2)
+				pdata->blocks |= STMPE_BLOCK_TOUCHSCREEN;
+		} else if (strcmp(tmp, "adc") == 0) {
+			/* the mfd core has no ADC cell, this module drives it */
+			sensors_adc_mask = adc_channels & 0xff;
+		} else if (strcmp(tmp, "temp") == 0) {
+			sensors_temp = true;
+		} else if (strcmp(tmp, "pwm") == 0) {
+			/* stmpe24xx only, the mfd core only warns on other variants */
+			pdata->blocks |= STMPE_BLOCK_PWM;
 		} else {
 			pr_err(DRVNAME": unrecognized value in module parameter 'blocks': %s\n", tmp);
 			return -EINVAL;
@@ -271,6 +1670,16 @@ static int __init stmpe_device_init(void)
 	stmpe_device.chip_select = cs;
 	stmpe_device.mode = mode;
 
+	if (autoprobe) {
+		if (strcmp(chip, "stmpe811")) {
+			pr_err(DRVNAME": autoprobe only supports the stmpe811\n");
+			return -EINVAL;
+		}
+		ret = autoprobe_spi(&stmpe_device);
+		if (ret)
+			return ret;
+	}
+
 	/* set platform_data values */
 	if (irq_gpio >= 0) {
 		pdata->irq_over_gpio = true;
@@ -281,7 +1690,8 @@ static int __init stmpe_device_init(void)
 	pdata->autosleep_timeout = autosleep_timeout;
 
 	pdata->gpio->gpio_base = gpio_base;
-	pdata->gpio->norequest_mask = norequest_mask;
+	/* the ADC inputs share pins with the GPIO block */
+	pdata->gpio->norequest_mask = norequest_mask | sensors_adc_mask;
 
 	pdata->ts->sample_time = sample_time;
 	pdata->ts->mod_12b = mod_12b;
@@ -305,7 +1715,8 @@ static int __init stmpe_device_init(void)
 			pr_pdata(gpio->gpio_base);
 			pr_pdata(gpio->norequest_mask);
 		}
-		if (pdata->blocks && STMPE_BLOCK_TOUCHSCREEN) {
+		if (ts_enabled) {
+			pr_info(DRVNAME":   fifo_th = %u\n", fifo_th);
 			pr_pdata(ts->sample_time);
 			pr_pdata(ts->mod_12b);
 			pr_pdata(ts->ref_sel);
@@ -316,6 +1727,11 @@ static int __init stmpe_device_init(void)
 			pr_pdata(ts->fraction_z);
 			pr_pdata(ts->i_drive);
 		}
+		if (sensors_adc_mask || sensors_temp) {
+			pr_info(DRVNAME":   adc_channels = 0x%02x\n", sensors_adc_mask);
+			pr_info(DRVNAME":   temp = %d\n", sensors_temp);
+			pr_info(DRVNAME":   adc_rate = %u\n", adc_rate);
+		}
 	}
 
 	if (pdata->irq_over_gpio && irq_pullup) {
@@ -328,10 +1744,60 @@ static int __init stmpe_device_init(void)
 		return ret;
 	}
 
+	debugfs_dir = debugfs_create_dir(DRVNAME, NULL);
+
+	if (pdata->blocks & STMPE_BLOCK_GPIO)
+		gpio_bulk_register();
+
+	if (ts_enabled && fifo_th > 1) {
+		ret = ts_batch_register(pdata->ts);
+		if (ret)
+			goto err_spi;
+	}
+
+	if (sensors_adc_mask || sensors_temp) {
+		ret = sensors_register(pdata->ts, ts_enabled);
+		if (ret)
+			goto err_ts;
+	}
+
+	if (ts_enabled) {
+		ret = calib_register(&calib_handler, "STMPE Touchscreen calibrated", 0,
+				     xres, yres, 0, 0xff);
+		if (ret)
+			goto err_sensors;
+	}
+
+	if (latency_stats) {
+		/* the board info has no irq, so it's only known with irq_gpio */
+		irq = pdata->irq_over_gpio ? gpio_to_irq(pdata->irq_gpio) : -ENXIO;
+		if (irq <= 0)
+			pr_warning(DRVNAME": latency_stats: no interrupt known, use irq_gpio. Only events are counted.\n");
+		ret = latency_register(irq);
+		if (ret)
+			goto err_calib;
+	}
+
 	if (verbose)
 		pr_spi_devices();
 
 	return 0;
+
+err_calib:
+	calib_unregister(&calib_handler);
+err_sensors:
+	sensors_unregister();
+err_ts:
+	ts_batch_unregister();
+err_spi:
+	gpio_bulk_unregister();
+	debugfs_remove_recursive(debugfs_dir);
+	if (stmpe_spi_device) {
+		device_del(&stmpe_spi_device->dev);
+		kfree(stmpe_spi_device);
+		stmpe_spi_device = NULL;
+	}
+	return ret;
 }
 
 static void __exit stmpe_device_exit(void)
@@ -339,6 +1805,13 @@ static void __exit stmpe_device_exit(void)
 	if (verbose)
 		pr_info(DRVNAME": %s()\n", __func__);
 
+	latency_unregister();
+	calib_unregister(&calib_handler);
+	sensors_unregister();
+	ts_batch_unregister();
+	gpio_bulk_unregister();
+	debugfs_remove_recursive(debugfs_dir);
+
 	if (stmpe_spi_device) {
 		device_del(&stmpe_spi_device->dev);
 		kfree(stmpe_spi_device);
@@ -0,0 +1,188 @@
+/*
+ * Touchscreen calibration for the *_device modules
+ *
+ * An input handler filter intercepts the events from the touchscreen and
+ * reports them on a second input device, with ABS_X/ABS_Y transformed to
+ * screen coordinates using a tslib pointercal matrix:
+ *   x' = (a * x + b * y + c) / s
+ *   y' = (d * x + e * y + f) / s
+ * The calibrated device is always registered. Until a matrix is written to
+ * the calibration parameter, at load time or later through
+ * /sys/module/<module>/parameters/calibration, the events are passed on
+ * untouched to the touchscreen's own handlers instead.
+ *
+ * The including module defines DRVNAME and registers an input handler
+ * with calib_filter() as its filter callback, matching the touchscreen
+ * but not calib_input.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _TOUCH_CALIB_H
+#define _TOUCH_CALIB_H
+
+#include <linux/kernel.h>
+#include <linux/moduleparam.h>
+#include <linux/input.h>
+#include <linux/lockdep.h>
+#include <linux/math64.h>
+#include <linux/spinlock.h>
+
+enum { CAL_A, CAL_B, CAL_C, CAL_D, CAL_E, CAL_F, CAL_S, CAL_NUM };
+
+static DEFINE_SPINLOCK(calib_lock);
+static int calib_matrix[CAL_NUM] = { 1, 0, 0, 0, 1, 0, 1 };
+static bool calib_enable;
+static struct input_dev *calib_input;
+static int calib_raw_x, calib_raw_y;
+static int calib_xres, calib_yres;
+
+static int calibration_set(const char *val, const struct kernel_param *kp)
+{
+	int m[CAL_NUM];
+	unsigned long flags;
+
+	/* a trailing xres yres (tslib >= 1.1) is accepted but not used */
+	if (sscanf(val, "%d %d %d %d %d %d %d", &m[CAL_A], &m[CAL_B], &m[CAL_C],
+		   &m[CAL_D], &m[CAL_E], &m[CAL_F], &m[CAL_S]) != CAL_NUM || !m[CAL_S]) {
+		pr_err(DRVNAME": calibration: expected 'a b c d e f s' with s != 0: %s\n", val);
+		return -EINVAL;
+	}
+
+	spin_lock_irqsave(&calib_lock, flags);
+	memcpy(calib_matrix, m, sizeof(calib_matrix));
+	calib_enable = true;
+	spin_unlock_irqrestore(&calib_lock, flags);
+
+	pr_debug(DRVNAME": calibration = %d %d %d %d %d %d %d\n",
+		 m[CAL_A], m[CAL_B], m[CAL_C], m[CAL_D], m[CAL_E], m[CAL_F], m[CAL_S]);
+
+	return 0;
+}
+
+static int calibration_get(char *buffer, const struct kernel_param *kp)
+{
+	int m[CAL_NUM];
+	unsigned long flags;
+
+	spin_lock_irqsave(&calib_lock, flags);
+	memcpy(m, calib_matrix, sizeof(m));
+	spin_unlock_irqrestore(&calib_lock, flags);
+
+	return sprintf(buffer, "%d %d %d %d %d %d %d",
+		       m[CAL_A], m[CAL_B], m[CAL_C], m[CAL_D], m[CAL_E], m[CAL_F], m[CAL_S]);
+}
+
+static const struct kernel_param_ops calibration_ops = {
+	.set = calibration_set,
+	.get = calibration_get,
+};
+
+module_param_cb(calibration, &calibration_ops, NULL, 0644);
+MODULE_PARM_DESC(calibration, "tslib pointercal matrix 'a b c d e f s', applied to the calibrated device (writable at runtime)");
+
+static void calib_report(const int *m)
+{
+	s64 x, y;
+
+	x = div_s64((s64)m[CAL_A] * calib_raw_x + (s64)m[CAL_B] * calib_raw_y + m[CAL_C], m[CAL_S]);
+	y = div_s64((s64)m[CAL_D] * calib_raw_x + (s64)m[CAL_E] * calib_raw_y + m[CAL_F], m[CAL_S]);
+
+	input_report_abs(calib_input, ABS_X, clamp_t(s64, x, 0, calib_xres - 1));
+	input_report_abs(calib_input, ABS_Y, clamp_t(s64, y, 0, calib_yres - 1));
+}
+
+/* called with the touchscreen's event_lock held */
+static bool calib_filter(struct input_handle *handle, unsigned int type,
+			 unsigned int code, int value)
+{
+	int m[CAL_NUM];
+	bool enable;
+
+	spin_lock(&calib_lock);
+	enable = calib_enable;
+	memcpy(m, calib_matrix, sizeof(m));
+	spin_unlock(&calib_lock);
+
+	if (!enable)
+		return false;
+
+	if (type == EV_ABS && code == ABS_X) {
+		calib_raw_x = value;
+		return true;
+	}
+	if (type == EV_ABS && code == ABS_Y) {
+		calib_raw_y = value;
+		return true;
+	}
+	if (type == EV_SYN && code == SYN_REPORT)
+		calib_report(m);
+
+	input_event(calib_input, type, code, value);
+
+	/* swallow the raw event */
+	return true;
+}
+
+static int calib_register(struct input_handler *handler, const char *name, u16 product,
+			  int xres, int yres, int pressure_min, int pressure_max)
+{
+	int ret;
+
+	if (xres < 1 || yres < 1) {
+		pr_err(DRVNAME": xres and yres must be non-zero\n");
+		return -EINVAL;
+	}
+	calib_xres = xres;
+	calib_yres = yres;
+
+	calib_input = input_allocate_device();
+	if (!calib_input)
+		return -ENOMEM;
+
+	/* events are passed on from within the touchscreen's event_lock */
+	lockdep_set_subclass(&calib_input->event_lock, SINGLE_DEPTH_NESTING);
+
+	calib_input->name = name;
+	calib_input->phys = DRVNAME"/input0";
+	calib_input->id.bustype = BUS_SPI;
+	calib_input->id.product = product;
+
+	input_set_capability(calib_input, EV_KEY, BTN_TOUCH);
+	input_set_abs_params(calib_input, ABS_X, 0, xres - 1, 0, 0);
+	input_set_abs_params(calib_input, ABS_Y, 0, yres - 1, 0, 0);
+	input_set_abs_params(calib_input, ABS_PRESSURE, pressure_min, pressure_max, 0, 0);
+
+	ret = input_register_device(calib_input);
+	if (ret) {
+		pr_err(DRVNAME": input_register_device() returned %d\n", ret);
+		input_free_device(calib_input);
+		calib_input = NULL;
+		return ret;
+	}
+
+	ret = input_register_handler(handler);
+	if (ret) {
+		pr_err(DRVNAME": input_register_handler() returned %d\n", ret);
+		input_unregister_device(calib_input);
+		calib_input = NULL;
+		return ret;
+	}
+
+	return 0;
+}
+
+static void calib_unregister(struct input_handler *handler)
+{
+	if (!calib_input)
+		return;
+
+	input_unregister_handler(handler);
+	input_unregister_device(calib_input);
+	calib_input = NULL;
+}
+
+#endif